@@ -0,0 +1,79 @@
+/*! @file
+ *  Cache line aligned allocation for the per-thread shards of the project-2
+ *  tools and insmix.
+ *
+ *  A shard is only written by its own thread. Padding the end of a shard
+ *  does not keep it off the lines of other allocations when the allocator
+ *  returns it unaligned, so shards and their counter arrays are allocated
+ *  on line boundaries and rounded up to whole lines:
+ *
+ *      class SHARD : public CACHE_ALIGNED { ... };
+ *      std::vector<UINT64, CACHE_ALIGNED_ALLOCATOR<UINT64> > counters;
+ *      COUNTER *chunk = static_cast<COUNTER *>(CacheAlignedAlloc(size));
+ */
+#ifndef CACHE_ALIGNED_H
+#define CACHE_ALIGNED_H
+
+#include "pin.H"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <new>
+
+const size_t CACHE_ALIGNMENT = 64;
+
+// size bytes, zeroed, on lines of their own; 0 if out of memory
+inline VOID *CacheAlignedAlloc(size_t size)
+{
+    size = (size + CACHE_ALIGNMENT - 1) & ~(CACHE_ALIGNMENT - 1);
+    VOID *p = 0;
+    if (posix_memalign(&p, CACHE_ALIGNMENT, size ? size : CACHE_ALIGNMENT) != 0){
+        return 0;
+    }
+    memset(p, 0, size);
+    return p;
+}
+
+inline VOID CacheAlignedFree(VOID *p)
+{
+    free(p);
+}
+
+// base class of objects allocated with new on lines of their own
+class CACHE_ALIGNED
+{
+  public:
+    static VOID *operator new(size_t size) { return CacheAlignedAlloc(size); }
+    static VOID operator delete(VOID *p) { CacheAlignedFree(p); }
+};
+
+// allocator for the containers of a shard (C++03 style, for STLport)
+template <class T>
+class CACHE_ALIGNED_ALLOCATOR
+{
+  public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    template <class U> struct rebind { typedef CACHE_ALIGNED_ALLOCATOR<U> other; };
+
+    CACHE_ALIGNED_ALLOCATOR() {}
+    template <class U> CACHE_ALIGNED_ALLOCATOR(const CACHE_ALIGNED_ALLOCATOR<U> &) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+    pointer allocate(size_type n, const VOID * = 0) { return static_cast<pointer>(CacheAlignedAlloc(n * sizeof(T))); }
+    VOID deallocate(pointer p, size_type) { CacheAlignedFree(p); }
+    size_type max_size() const { return size_type(-1) / sizeof(T); }
+    VOID construct(pointer p, const T &value) { new (p) T(value); }
+    VOID destroy(pointer p) { p->~T(); }
+
+    template <class U> bool operator==(const CACHE_ALIGNED_ALLOCATOR<U> &) const { return true; }
+    template <class U> bool operator!=(const CACHE_ALIGNED_ALLOCATOR<U> &) const { return false; }
+};
+
+#endif // CACHE_ALIGNED_H
@@ -16,6 +16,18 @@
 #include "pin.H"
 #include <iostream>
 #include <string.h>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <map>
+#include "rtn_table.h"
+#include "cct.h"
+#include "shadow_stack.h"
+#include "log_histogram.h"
+#include "fast_forward.h"
+#include "snapshot.h"
+#include "trace_compressor.h"
+#include "space_saving.h"
 using std::cerr;
 using std::endl;
 using std::string;
@@ -25,15 +37,224 @@ using std::string;
 /* ===================================================================== */
 
 // COS375 TIP: Add global variables here 
-string routineName;
+
+// interned routine names; analysis code only sees the ids
+RTN_TABLE rtnTable;
 bool foundMain = false;
 FILE *outFile;
-int currentDepth = 0; // tracks the depth/level of the current routine
+
+// Routine entries traced but not written yet. Every thread fills its own
+// buffer; full buffers are queued to an internal writer thread that
+// formats them, so the application threads never format or do I/O. The
+// text of one thread is unchanged, but with several threads the trace is
+// written a buffer (up to EVENT_BUFFER_SIZE entries) of a thread at a
+// time instead of interleaving the threads entry by entry
+// (-streams: the writer writes every buffer to the file of its thread, and
+// time stamp counter anchors are interleaved with the entries)
+struct event_t
+{
+    UINT32 routineId;   // INVALID_RTN_ID: -streams anchor
+    INT32 depth;
+    ADDRINT argZero;    // anchor: time stamp counter
+    UINT64 count;       // -streams: instructions of the thread so far
+};
+#define EVENT_BUFFER_SIZE 4096
+class thread_data_t;
+struct event_buffer_t
+{
+    thread_data_t *owner;  // thread that filled the buffer
+    UINT32 size;
+    bool last;             // -streams: the owner has ended, close its stream
+    event_t events[EVENT_BUFFER_SIZE];
+};
+
+std::vector<event_buffer_t *> fullBuffers;  // in the order they filled up
+std::vector<event_buffer_t *> freeBuffers;  // written, ready for reuse
+PIN_LOCK bufferLock;       // guards the two lists
+PIN_LOCK writeLock;        // held while formatting into outFile
+PIN_SEMAPHORE buffersFull; // set when fullBuffers is not empty
+PIN_THREAD_UID writerUid;
+volatile bool writerExit = false;
+
+// -cct: every thread builds a calling context tree instead of the trace
+const UINT32 INVALID_RTN_ID = ~0u;
+
+// -folded: a stack seen by a thread, identified by a hash of its routine
+// ids that is extended on every call; the stack is rebuilt from the parent
+// entries only when the output is written. Entries are never erased, so
+// the parent pointers stay valid.
+struct folded_t
+{
+    UINT64 hash;        // key of the entry in its thread's map
+    folded_t *parent;   // stack without its top, 0 for the empty stack
+    UINT32 depth;       // routines on the stack
+    UINT32 routineId;   // top of the stack
+    UINT64 calls;
+    UINT64 instructions;
+};
+typedef std::unordered_map<UINT64, folded_t> folded_map_t;
+
+// hash of the empty stack
+const UINT64 FOLDED_ROOT_HASH = 0xcbf29ce484222325ULL;
+BOOL foldedStacks = false;
+BOOL foldedByInstructions = false;  // weight of a stack, calls otherwise
+
+// -edges: a call edge, from the address of the call instruction to the
+// entry of the callee; symbolized only when the output is written
+struct edge_t
+{
+    ADDRINT site;
+    ADDRINT target;
+    bool operator==(const edge_t &other) const
+    {
+        return site == other.site && target == other.target;
+    }
+};
+
+struct edge_hash_t
+{
+    size_t operator()(const edge_t &edge) const
+    {
+        return (edge.site * 0x9e3779b97f4a7c15ULL) ^ edge.target;
+    }
+};
+typedef std::unordered_map<edge_t, UINT64, edge_hash_t> edge_map_t;
+
+// -latency: distributions of the instructions and time stamp counter
+// cycles taken by each invocation of a routine, callees included
+struct latency_t
+{
+    LOG_HISTOGRAM instructions;
+    LOG_HISTOGRAM cycles;
+};
+
+// -memo: how often a routine is called again with arguments it has already
+// seen, by a bounded table of the hashes of its first arguments
+#define MAX_MEMO_ARGS 6
+const UINT32 MEMO_REPEAT = 1;  // frame mark: arguments seen before
+const UINT32 MEMO_SAVED = 2;   // frame mark: and no repeated caller of the routine is open
+const UINT64 MEMO_HASH_SEED = 0xcbf29ce484222325ULL;  // FNV-1a offset basis of the argument hash
+struct memo_t
+{
+    memo_t(UINT32 slots) : table(slots), repeats(0), saved(0), openRepeats(0) {}
+    SPACE_SAVING table;   // argument hashes
+    UINT64 repeats;       // calls with arguments in the table
+    UINT64 saved;         // instructions of the outermost repeated calls
+    UINT32 openRepeats;   // repeated calls on the shadow stack
+};
+
+// -indirect: an indirect call or jump; numbered at instrumentation time so
+// the threads index their target tables by id
+struct indirect_site_t
+{
+    ADDRINT address;
+    bool isCall;
+};
+std::vector<indirect_site_t> indirectSites;
+std::unordered_map<ADDRINT, UINT32> indirectSiteIds;
+
+// -inline: static size of the routines, by routine id, and the routine
+// entered at each entry address; recorded when a routine is instrumented
+struct routine_size_t
+{
+    UINT32 instructions;
+    USIZE bytes;
+};
+std::vector<routine_size_t> routineSizes;
+std::unordered_map<ADDRINT, UINT32> routineEntries;
+
+// -inline: invocations of a routine and the instructions they executed,
+// callees included
+struct call_cost_t
+{
+    UINT64 calls;
+    UINT64 instructions;
+};
+
+class thread_data_t
+{
+  public:
+    thread_data_t(THREADID tid) : tid(tid), count(0), attributed(0),
+        root(INVALID_RTN_ID, 0), current(&root), lastEdgeCount(0), events(0), stream(0), sinceAnchor(0)
+    {
+        lastEdge.site = 0;
+        lastEdge.target = 0;
+        folded_t empty = { FOLDED_ROOT_HASH, 0, 0, INVALID_RTN_ID, 0, 0 };
+        stack.push_back(&(folded[FOLDED_ROOT_HASH] = empty));
+    }
+    THREADID tid;
+    UINT64 count;       // instructions executed by this thread since main
+    UINT64 attributed;  // part of count already charged to a context
+    CCT_NODE root;      // the contexts of the thread hang off this node
+    CCT_NODE *current;  // context being executed
+    folded_map_t folded;             // -folded: stacks seen by this thread
+    std::vector<folded_t *> stack;   // -folded: entries of the current stack
+    SHADOW_STACK frames;  // routines entered and not left; gives the depth
+    edge_map_t edges;     // -edges: calls per edge
+    edge_t lastEdge;      // -edges: the edge last counted by this thread
+    UINT64 *lastEdgeCount;
+    std::vector<latency_t *> latency;  // -latency: by routine id, allocated on first use
+    std::vector<memo_t *> memo;        // -memo: by routine id, allocated on first use
+    std::vector<SPACE_SAVING *> indirect;  // -indirect: targets by site id, allocated on first use
+    std::vector<call_cost_t> callCosts;    // -inline: by routine id
+    event_buffer_t *events;            // buffer being filled by this thread
+    FILE *stream;                      // -streams: call_graph.<tid>.out
+    UINT32 sinceAnchor;                // -streams: entries since the last anchor
+    TRACE_COMPRESSOR compressed;       // -compress: the trace of this thread so far
+};
+
+// indexed by thread id, so the analysis routines stay branch free
+static thread_data_t *threadData[PIN_MAX_THREADS];
+
+// every thread that was started; the trees are kept until Fini
+std::vector<thread_data_t *> threads;
+PIN_LOCK threadLock;
+
+// -ff: skips instructions before any tracing is instrumented
+FAST_FORWARD fastForward;
+
+// records how far the output has got when the snapshot signal arrives
+SNAPSHOT snapshot;
 
 /* ===================================================================== */
 /* Commandline Switches */
 /* ===================================================================== */
 
+KNOB<BOOL> KnobCct(KNOB_MODE_WRITEONCE, "pintool",
+    "cct", "0", "build a calling context tree per thread and write it at exit instead of the call trace");
+KNOB<string> KnobFolded(KNOB_MODE_WRITEONCE, "pintool",
+    "folded", "", "write folded stacks (flame graph input) weighted by calls or instructions instead of the call trace");
+KNOB<BOOL> KnobEdges(KNOB_MODE_WRITEONCE, "pintool",
+    "edges", "0", "count calls per (call site, callee) edge; write an edge list instead of the call trace, and call_graph.dot");
+KNOB<BOOL> KnobLatency(KNOB_MODE_WRITEONCE, "pintool",
+    "latency", "0", "write p50/p99/max instructions and cycles per invocation of each routine instead of the call trace");
+KNOB<string> KnobLatencyRoutines(KNOB_MODE_APPEND, "pintool",
+    "latency_rtn", "", "routine timed by -latency (may be repeated; default: all routines)");
+KNOB<BOOL> KnobMemo(KNOB_MODE_WRITEONCE, "pintool",
+    "memo", "0", "write the routines often called again with the same arguments, and the instructions memoizing them would save, instead of the call trace");
+KNOB<UINT32> KnobMemoArgs(KNOB_MODE_WRITEONCE, "pintool",
+    "memo_args", "2", "number of integer arguments compared by -memo (at most 6)");
+KNOB<UINT32> KnobMemoSlots(KNOB_MODE_WRITEONCE, "pintool",
+    "memo_slots", "32", "argument hashes tracked per routine and thread by -memo");
+KNOB<UINT32> KnobMemoMin(KNOB_MODE_WRITEONCE, "pintool",
+    "memo_min", "50", "percentage of repeated calls from which -memo reports a routine");
+KNOB<BOOL> KnobIndirect(KNOB_MODE_WRITEONCE, "pintool",
+    "indirect", "0", "write the most frequent targets of every indirect call and jump instead of the call trace");
+KNOB<UINT32> KnobIndirectTargets(KNOB_MODE_WRITEONCE, "pintool",
+    "indirect_targets", "4", "targets tracked per site and thread by -indirect");
+KNOB<BOOL> KnobInline(KNOB_MODE_WRITEONCE, "pintool",
+    "inline", "0", "write the call sites of small routines ranked by instructions saved per instruction of code growth, instead of the call trace");
+KNOB<UINT32> KnobInlineMax(KNOB_MODE_WRITEONCE, "pintool",
+    "inline_max", "64", "-inline: largest callee considered, in static instructions");
+KNOB<UINT32> KnobInlineCost(KNOB_MODE_WRITEONCE, "pintool",
+    "inline_cost", "4", "-inline: instructions saved per inlined call (call, return and frame setup)");
+KNOB<BOOL> KnobCompress(KNOB_MODE_WRITEONCE, "pintool",
+    "compress", "0", "write the call trace per thread at exit with repeated subtrees and recursion run-length encoded (see call_graph_expand)");
+KNOB<BOOL> KnobStreams(KNOB_MODE_WRITEONCE, "pintool",
+    "streams", "0", "write the call trace of every thread to call_graph.<tid>.out, stamped for call_graph_merge");
+KNOB<UINT32> KnobStreamAnchor(KNOB_MODE_WRITEONCE, "pintool",
+    "stream_anchor", "1024", "routine entries between the time stamp counter anchors of -streams");
+
 
 /* ===================================================================== */
 /* Print Help Message                                                    */
@@ -53,34 +274,747 @@ INT32 Usage()
 }
 
 /* ===================================================================== */
+// Calling context tree (-cct)
+
+// call-back for each instruction
+VOID PIN_FAST_ANALYSIS_CALL countInstruction(THREADID tid)
+{
+    threadData[tid]->count += foundMain;
+}
+
+// charges the instructions counted since the last call or return to the
+// current context (and the current stack, for -folded)
+VOID attributeCount(thread_data_t *tdata)
+{
+    UINT64 count = tdata->count - tdata->attributed;
+    tdata->current->instructions += count;
+    tdata->stack.back()->instructions += count;
+    tdata->attributed = tdata->count;
+}
+
+VOID enterContext(thread_data_t *tdata, UINT32 routineId)
+{
+    attributeCount(tdata);
+    tdata->current = tdata->current->Child(routineId);
+    tdata->current->calls++;
+}
+
+VOID leaveContext(thread_data_t *tdata)
+{
+    attributeCount(tdata);
+    if (tdata->current != &tdata->root){
+        tdata->current = tdata->current->parent;
+    }
+}
+
+/* ===================================================================== */
+// Folded stacks (-folded)
+
+VOID pushStack(thread_data_t *tdata, UINT32 routineId)
+{
+    attributeCount(tdata);
+    folded_t *parent = tdata->stack.back();
+    UINT64 hash = ((parent->hash << 5) | (parent->hash >> 59)) ^ ((routineId + 1) * 0x9e3779b97f4a7c15ULL);
+    folded_map_t::iterator it = tdata->folded.find(hash);
+    // the hash of another stack: probe the next keys
+    while (it != tdata->folded.end() && (it->second.parent != parent || it->second.routineId != routineId)){
+        it = tdata->folded.find(++hash);
+    }
+    if (it == tdata->folded.end()){
+        folded_t entry = { hash, parent, parent->depth + 1, routineId, 0, 0 };
+        it = tdata->folded.insert(std::make_pair(hash, entry)).first;
+    }
+    it->second.calls++;
+    tdata->stack.push_back(&it->second);
+}
+
+VOID popStack(thread_data_t *tdata)
+{
+    attributeCount(tdata);
+    if (tdata->stack.size() > 1){
+        tdata->stack.pop_back();
+    }
+}
+
+// writes "main;foo;bar weight" for every stack seen by any thread. The
+// threads may key the same stack differently, so they are merged by path.
+VOID writeFolded(FILE *out)
+{
+    std::map<string, UINT64> merged;
+    std::vector<UINT32> path;
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        attributeCount(threads[i]);
+        folded_map_t &folded = threads[i]->folded;
+        for (folded_map_t::iterator it = folded.begin(); it != folded.end(); ++it){
+            const folded_t &entry = it->second;
+            UINT64 weight = foldedByInstructions ? entry.instructions : entry.calls;
+            if (entry.depth == 0 || weight == 0){
+                continue;
+            }
+            path.clear();
+            for (const folded_t *f = &entry; path.size() < entry.depth; f = f->parent){
+                path.push_back(f->routineId);
+            }
+            string name;
+            for (size_t p = path.size(); p > 0; p--){
+                name += rtnTable.Name(path[p - 1]);
+                name += p > 1 ? ";" : "";
+            }
+            merged[name] += weight;
+        }
+    }
+    PIN_ReleaseLock(&threadLock);
+
+    for (std::map<string, UINT64>::iterator it = merged.begin(); it != merged.end(); ++it){
+        fprintf(out, "%s %lu\n", it->first.c_str(), it->second);
+    }
+}
+
+/* ===================================================================== */
+// Call edges (-edges)
+
+// call-back for each call instruction. Loops tend to repeat the same call,
+// so the edge last counted is checked before the hash table.
+VOID countEdge(THREADID tid, ADDRINT site, ADDRINT target)
+{
+    if (!foundMain){
+        return;
+    }
+    thread_data_t *tdata = threadData[tid];
+    if (tdata->lastEdge.site == site && tdata->lastEdge.target == target && tdata->lastEdgeCount){
+        (*tdata->lastEdgeCount)++;
+        return;
+    }
+    tdata->lastEdge.site = site;
+    tdata->lastEdge.target = target;
+    tdata->lastEdgeCount = &tdata->edges[tdata->lastEdge];
+    (*tdata->lastEdgeCount)++;
+}
+
+// name of the routine containing address, looked up from the symbols
+string symbolize(ADDRINT address)
+{
+    PIN_LockClient();
+    string name = RTN_FindNameByAddress(address);
+    PIN_UnlockClient();
+    return name.empty() ? hexstr(address) : name;
+}
+
+// the calls per edge of all threads
+edge_map_t mergeEdges()
+{
+    edge_map_t merged;
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        edge_map_t &edges = threads[i]->edges;
+        for (edge_map_t::iterator it = edges.begin(); it != edges.end(); ++it){
+            merged[it->first] += it->second;
+        }
+    }
+    PIN_ReleaseLock(&threadLock);
+    return merged;
+}
+
+// Writes the edges of all threads as "0xsite caller callee calls" lines to
+// out and, if dot is not null, as a graph with one arc per caller/callee
+// pair weighted by the calls over all of its call sites
+VOID writeEdges(FILE *out, FILE *dot)
+{
+    edge_map_t merged = mergeEdges();
+    std::map<std::pair<string, string>, UINT64> arcs;
+    for (edge_map_t::iterator it = merged.begin(); it != merged.end(); ++it){
+        string caller = symbolize(it->first.site);
+        string callee = symbolize(it->first.target);
+        fprintf(out, "0x%lx %s %s %lu\n", it->first.site, caller.c_str(), callee.c_str(), it->second);
+        arcs[std::make_pair(caller, callee)] += it->second;
+    }
+    if (dot == 0){
+        return;
+    }
+    fprintf(dot, "digraph call_graph {\n");
+    for (std::map<std::pair<string, string>, UINT64>::iterator it = arcs.begin(); it != arcs.end(); ++it){
+        fprintf(dot, "    \"%s\" -> \"%s\" [label=\"%lu\"];\n",
+            it->first.first.c_str(), it->first.second.c_str(), it->second);
+    }
+    fprintf(dot, "}\n");
+}
+
+/* ===================================================================== */
+// Indirect branch targets (-indirect)
+
+// call-back for each indirect call or jump. The table checks the target it
+// counted last before the others, so monomorphic sites stay cheap.
+VOID countIndirect(THREADID tid, UINT32 siteId, ADDRINT target)
+{
+    if (!foundMain){
+        return;
+    }
+    thread_data_t *tdata = threadData[tid];
+    if (siteId >= tdata->indirect.size()){
+        tdata->indirect.resize(siteId + 1, 0);
+    }
+    SPACE_SAVING *targets = tdata->indirect[siteId];
+    if (targets == 0){
+        targets = tdata->indirect[siteId] = new SPACE_SAVING(KnobIndirectTargets);
+    }
+    targets->Offer(target);
+}
+
+// id of the indirect branch ins (instrumentation time)
+UINT32 indirectSiteId(INS ins)
+{
+    ADDRINT address = INS_Address(ins);
+    std::unordered_map<ADDRINT, UINT32>::const_iterator it = indirectSiteIds.find(address);
+    if (it != indirectSiteIds.end()){
+        return it->second;
+    }
+    indirect_site_t site = { address, INS_IsCall(ins) };
+    indirectSites.push_back(site);
+    return indirectSiteIds[address] = indirectSites.size() - 1;
+}
+
+// Writes "0xsite caller call|jump executions target:fraction ..." per site,
+// most executed first, with the -indirect_targets most frequent targets.
+// The tables of the threads are added up, so counts are estimates when a
+// site had more targets than a table holds.
+VOID writeIndirect(FILE *out)
+{
+    std::vector<std::map<ADDRINT, UINT64> > merged(indirectSites.size());
+    std::vector<std::pair<UINT64, UINT32> > order;
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        std::vector<SPACE_SAVING *> &indirect = threads[i]->indirect;
+        for (size_t id = 0; id < indirect.size(); id++){
+            if (indirect[id] == 0){
+                continue;
+            }
+            std::vector<space_saving_entry_t> top = indirect[id]->Top();
+            for (size_t t = 0; t < top.size(); t++){
+                merged[id][top[t].key] += top[t].count;
+            }
+        }
+    }
+    PIN_ReleaseLock(&threadLock);
+
+    for (UINT32 id = 0; id < merged.size(); id++){
+        UINT64 total = 0;
+        for (std::map<ADDRINT, UINT64>::iterator it = merged[id].begin(); it != merged[id].end(); ++it){
+            total += it->second;
+        }
+        if (total != 0){
+            order.push_back(std::make_pair(total, id));
+        }
+    }
+    std::sort(order.rbegin(), order.rend());
+
+    for (size_t i = 0; i < order.size(); i++){
+        UINT64 total = order[i].first;
+        const indirect_site_t &site = indirectSites[order[i].second];
+        std::vector<std::pair<UINT64, ADDRINT> > targets;
+        std::map<ADDRINT, UINT64> &counts = merged[order[i].second];
+        for (std::map<ADDRINT, UINT64>::iterator it = counts.begin(); it != counts.end(); ++it){
+            targets.push_back(std::make_pair(it->second, it->first));
+        }
+        std::sort(targets.rbegin(), targets.rend());
+        fprintf(out, "0x%lx %s %s %lu", site.address, symbolize(site.address).c_str(),
+            site.isCall ? "call" : "jump", total);
+        for (size_t t = 0; t < targets.size() && t < KnobIndirectTargets; t++){
+            fprintf(out, " %s:%.3f", symbolize(targets[t].second).c_str(), (double)targets[t].first / total);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+/* ===================================================================== */
+// Inline candidates (-inline)
+
+// records the static size of rtn (instrumentation time)
+VOID recordRoutineSize(RTN rtn)
+{
+    UINT32 id = rtnTable.Intern(rtn);
+    if (id >= routineSizes.size()){
+        routine_size_t unknown = { 0, 0 };
+        routineSizes.resize(id + 1, unknown);
+    }
+    RTN_Open(rtn);
+    routineSizes[id].instructions = RTN_NumIns(rtn);
+    routineSizes[id].bytes = RTN_Size(rtn);
+    RTN_Close(rtn);
+    routineEntries[RTN_Address(rtn)] = id;
+}
+
+// a frame has been left; charges its instructions to its routine
+VOID recordCallCost(thread_data_t *tdata, const shadow_frame_t &frame)
+{
+    UINT32 id = frame.routineId;
+    if (id >= tdata->callCosts.size()){
+        call_cost_t none = { 0, 0 };
+        tdata->callCosts.resize(id + 1, none);
+    }
+    tdata->callCosts[id].calls++;
+    tdata->callCosts[id].instructions += tdata->count - frame.entryCount;
+}
+
+// Writes "0xsite caller callee calls instructions bytes instructions/call
+// sites saved saved% benefit growth score" per call site of a routine of
+// at most -inline_max static instructions, highest score first. saved is
+// calls times -inline_cost and saved% its share of all instructions
+// executed; instructions/call includes the callees of the callee.
+//   benefit  dynamic instructions: saved weighted by the share of a call
+//            that is overhead, cost / (cost + instructions/call), so calls
+//            of tiny routines count more than calls doing much work
+//   growth   static instructions: the callee copied to all its sites,
+//            instructions * sites
+//   score    benefit / growth, instructions saved per instruction of code
+//            growth, so the two units are never mixed
+VOID writeInline(FILE *out)
+{
+    struct candidate_t
+    {
+        ADDRINT site;
+        UINT32 callee;
+        UINT64 calls;
+        double benefit;
+        double growth;
+        double score;
+        bool operator<(const candidate_t &other) const { return score > other.score; }
+    };
+    edge_map_t edges = mergeEdges();
+    std::vector<call_cost_t> costs(rtnTable.Size());
+    UINT64 total = 0;
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        std::vector<call_cost_t> &callCosts = threads[i]->callCosts;
+        for (size_t id = 0; id < callCosts.size(); id++){
+            costs[id].calls += callCosts[id].calls;
+            costs[id].instructions += callCosts[id].instructions;
+        }
+        total += threads[i]->count;
+    }
+    PIN_ReleaseLock(&threadLock);
+
+    std::vector<candidate_t> candidates;
+    std::vector<UINT32> sites(rtnTable.Size());
+    for (edge_map_t::iterator it = edges.begin(); it != edges.end(); ++it){
+        std::unordered_map<ADDRINT, UINT32>::const_iterator entry = routineEntries.find(it->first.target);
+        if (entry == routineEntries.end() || routineSizes[entry->second].instructions > KnobInlineMax){
+            continue;
+        }
+        candidate_t candidate = { it->first.site, entry->second, it->second, 0, 0, 0 };
+        candidates.push_back(candidate);
+        sites[entry->second]++;
+    }
+    for (size_t i = 0; i < candidates.size(); i++){
+        candidate_t &candidate = candidates[i];
+        const call_cost_t &cost = costs[candidate.callee];
+        double perCall = cost.calls ? (double)cost.instructions / cost.calls : 0.0;
+        double overhead = (double)KnobInlineCost / (KnobInlineCost + perCall);
+        candidate.benefit = (double)candidate.calls * KnobInlineCost * overhead;
+        candidate.growth = (double)routineSizes[candidate.callee].instructions * sites[candidate.callee];
+        candidate.score = candidate.growth > 0 ? candidate.benefit / candidate.growth : candidate.benefit;
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    for (size_t i = 0; i < candidates.size(); i++){
+        const candidate_t &candidate = candidates[i];
+        const routine_size_t &size = routineSizes[candidate.callee];
+        const call_cost_t &cost = costs[candidate.callee];
+        UINT64 saved = candidate.calls * KnobInlineCost;
+        fprintf(out, "0x%lx %s %s %lu %u %lu %.1f %u %lu %.2f%% %.0f %.0f %.1f\n", candidate.site,
+            symbolize(candidate.site).c_str(), rtnTable.Name(candidate.callee).c_str(), candidate.calls,
+            size.instructions, (UINT64)size.bytes, cost.calls ? (double)cost.instructions / cost.calls : 0.0,
+            sites[candidate.callee], saved, total ? 100.0 * saved / total : 0.0,
+            candidate.benefit, candidate.growth, candidate.score);
+    }
+}
+
+/* ===================================================================== */
+// writes the tree of every thread
+VOID writeTrees(FILE *out)
+{
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        attributeCount(threads[i]);
+        fprintf(out, "thread %u\n", threads[i]->tid);
+        threads[i]->root.Write(out, rtnTable);
+    }
+    PIN_ReleaseLock(&threadLock);
+}
+
+/* ===================================================================== */
+// Latency distributions (-latency)
+
+static inline UINT64 readTsc()
+{
+    UINT32 low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((UINT64)high << 32) | low;
+}
+
+// is the routine timed by -latency? (instrumentation time)
+BOOL timedRoutine(UINT32 routineId)
+{
+    if (!KnobLatency){
+        return false;
+    }
+    if (KnobLatencyRoutines.NumberOfValues() == 0){
+        return true;
+    }
+    for (UINT32 i = 0; i < KnobLatencyRoutines.NumberOfValues(); i++){
+        if (KnobLatencyRoutines.Value(i) == rtnTable.Name(routineId)){
+            return true;
+        }
+    }
+    return false;
+}
+
+// records the invocation of a timed frame that has just been left
+VOID recordLatency(thread_data_t *tdata, const shadow_frame_t &frame, UINT64 now)
+{
+    UINT32 id = frame.routineId;
+    if (id >= tdata->latency.size()){
+        tdata->latency.resize(id + 1, 0);
+    }
+    if (tdata->latency[id] == 0){
+        tdata->latency[id] = new latency_t;
+    }
+    tdata->latency[id]->instructions.Record(tdata->count - frame.entryCount);
+    tdata->latency[id]->cycles.Record(now - frame.entryTime);
+}
+
+// writes "name:calls:p50:p99:max:p50:p99:max" per timed routine,
+// instructions first and cycles second
+VOID writeLatency(FILE *out)
+{
+    std::vector<latency_t *> merged(rtnTable.Size(), 0);
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        std::vector<latency_t *> &latency = threads[i]->latency;
+        for (size_t id = 0; id < latency.size(); id++){
+            if (latency[id] == 0){
+                continue;
+            }
+            if (merged[id] == 0){
+                merged[id] = new latency_t;
+            }
+            merged[id]->instructions.Add(latency[id]->instructions);
+            merged[id]->cycles.Add(latency[id]->cycles);
+        }
+    }
+    PIN_ReleaseLock(&threadLock);
+
+    for (size_t id = 0; id < merged.size(); id++){
+        if (merged[id] == 0){
+            continue;
+        }
+        const LOG_HISTOGRAM &instructions = merged[id]->instructions;
+        const LOG_HISTOGRAM &cycles = merged[id]->cycles;
+        fprintf(out, "%s:%lu:%lu:%lu:%lu:%lu:%lu:%lu\n", rtnTable.Name(id).c_str(), instructions.Total(),
+            instructions.Percentile(0.5), instructions.Percentile(0.99), instructions.Max(),
+            cycles.Percentile(0.5), cycles.Percentile(0.99), cycles.Max());
+        delete merged[id];
+    }
+}
+
+/* ===================================================================== */
+// Memoization opportunities (-memo)
+
+// call-back after executeBeforeRoutine, with the first -memo_args
+// arguments of the routine just pushed (the others are 0). Both calls are
+// inserted before the routine's first instruction, executeBeforeRoutine
+// first, and Pin runs the calls of one point in insertion order; both
+// return early without foundMain. frames.Top() is therefore the frame
+// executeBeforeRoutine pushed for this invocation.
+VOID executeMemoEntry(THREADID tid, UINT32 routineId, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2,
+    ADDRINT arg3, ADDRINT arg4, ADDRINT arg5)
+{
+    if (!foundMain){
+        return;
+    }
+    thread_data_t *tdata = threadData[tid];
+    if (routineId >= tdata->memo.size()){
+        tdata->memo.resize(routineId + 1, 0);
+    }
+    memo_t *memo = tdata->memo[routineId];
+    if (memo == 0){
+        memo = tdata->memo[routineId] = new memo_t(KnobMemoSlots);
+    }
+
+    const ADDRINT args[MAX_MEMO_ARGS] = { arg0, arg1, arg2, arg3, arg4, arg5 };
+    UINT64 hash = MEMO_HASH_SEED;
+    for (UINT32 i = 0; i < MAX_MEMO_ARGS; i++){
+        hash = (hash ^ args[i]) * 0x100000001b3ULL;
+    }
+    if (!memo->table.Offer(hash)){
+        return;
+    }
+    // a repeated call inside another one of the same routine would not
+    // happen at all once the routine is memoized
+    memo->repeats++;
+    tdata->frames.Top().mark = MEMO_REPEAT | (memo->openRepeats == 0 ? MEMO_SAVED : 0);
+    memo->openRepeats++;
+}
+
+// a frame of a repeated call has been left
+VOID leaveMemoFrame(thread_data_t *tdata, const shadow_frame_t &frame)
+{
+    memo_t *memo = tdata->memo[frame.routineId];
+    memo->openRepeats--;
+    if (frame.mark & MEMO_SAVED){
+        memo->saved += tdata->count - frame.entryCount;
+    }
+}
+
+// writes "name:calls:repeats:saved instructions" for the routines with at
+// least -memo_min percent repeated calls, most instructions saved first
+VOID writeMemo(FILE *out)
+{
+    struct memo_total_t
+    {
+        UINT32 routineId;
+        UINT64 calls;
+        UINT64 repeats;
+        UINT64 saved;
+        bool operator<(const memo_total_t &other) const { return saved > other.saved; }
+    };
+    std::vector<memo_total_t> totals(rtnTable.Size());
+    for (UINT32 id = 0; id < totals.size(); id++){
+        memo_total_t empty = { id, 0, 0, 0 };
+        totals[id] = empty;
+    }
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        std::vector<memo_t *> &memo = threads[i]->memo;
+        for (size_t id = 0; id < memo.size(); id++){
+            if (memo[id] != 0){
+                totals[id].calls += memo[id]->table.Total();
+                totals[id].repeats += memo[id]->repeats;
+                totals[id].saved += memo[id]->saved;
+            }
+        }
+    }
+    PIN_ReleaseLock(&threadLock);
+
+    std::sort(totals.begin(), totals.end());
+    for (size_t i = 0; i < totals.size(); i++){
+        const memo_total_t &total = totals[i];
+        if (total.calls == 0 || total.repeats * 100 < total.calls * KnobMemoMin){
+            continue;
+        }
+        fprintf(out, "%s:%lu:%lu:%lu\n", rtnTable.Name(total.routineId).c_str(),
+            total.calls, total.repeats, total.saved);
+    }
+}
+
+/* ===================================================================== */
+// Pops the frames that have been left by the time a routine is entered, or
+// returns, with stack pointer sp: the returning frame, but also frames
+// skipped by longjmp, exceptions or tail calls
+VOID unwindFrames(thread_data_t *tdata, ADDRINT sp)
+{
+    UINT64 now = KnobLatency && tdata->frames.Stale(sp) ? readTsc() : 0;
+    while (tdata->frames.Stale(sp)){
+        // frames that are not timed have no entry time
+        if (tdata->frames.Top().entryTime != 0){
+            recordLatency(tdata, tdata->frames.Top(), now);
+        }
+        if (tdata->frames.Top().mark != 0){
+            leaveMemoFrame(tdata, tdata->frames.Top());
+        }
+        if (KnobInline){
+            recordCallCost(tdata, tdata->frames.Top());
+        }
+        if (KnobCct){
+            leaveContext(tdata);
+        }
+        else if (foldedStacks){
+            popStack(tdata);
+        }
+        tdata->frames.Pop();
+    }
+}
 
-// callback function for function call instructions
-// increments routine depth/level
-VOID incrementDepth()
+// call-back for each return instruction
+VOID executeAtReturn(THREADID tid, ADDRINT sp)
 {
-    if (foundMain){
-        currentDepth++; 
+    if (!foundMain){
+        return;
     }
+    unwindFrames(threadData[tid], sp);
 }
 
-// callback function for function exit instructions
-// decrements routine depth/level
-VOID decrementDepth()
+/* ===================================================================== */
+// Call trace output
+
+VOID closeStream(thread_data_t *tdata);
+
+// Writes the routine entries in buffer to outFile (-compress: adds them to
+// the compressed trace of their thread); caller holds writeLock. -streams:
+// writes them to the stream of their thread as "e <count> <depth> 0xarg
+// name" and the anchors as "a <count> <tsc>", and closes the stream after
+// the last buffer of the thread.
+VOID writeEvents(event_buffer_t *buffer)
 {
-    if (foundMain){
-        currentDepth--;
+    if (KnobStreams){
+        FILE *stream = buffer->owner->stream;
+        for (UINT32 i = 0; stream != 0 && i < buffer->size; i++){
+            const event_t &event = buffer->events[i];
+            if (event.routineId == INVALID_RTN_ID){
+                fprintf(stream, "a %lu %lu\n", event.count, event.argZero);
+            }
+            else{
+                fprintf(stream, "e %lu %d 0x%lx %s\n", event.count, event.depth, event.argZero,
+                    rtnTable.Name(event.routineId).c_str());
+            }
+        }
+        if (buffer->last){
+            closeStream(buffer->owner);
+        }
+        buffer->size = 0;
+        return;
+    }
+
+    if (KnobCompress){
+        for (UINT32 i = 0; i < buffer->size; i++){
+            const event_t &event = buffer->events[i];
+            buffer->owner->compressed.Add(event.routineId, event.depth, event.argZero);
+        }
+        buffer->size = 0;
+        return;
+    }
+
+    // prints the appropriate number of spaces based on depth, prints routine name
+    // and 1st argument in hex
+    for (UINT32 i = 0; i < buffer->size; i++){
+        const event_t &event = buffer->events[i];
+        fprintf(outFile, "%*s%s(0x%lx,...)\n", event.depth > 0 ? event.depth : 0, "",
+            rtnTable.Name(event.routineId).c_str(), event.argZero);
+    }
+    buffer->size = 0;
+}
+
+// writes the queued buffers; caller holds writeLock
+VOID writeFullBuffers()
+{
+    PIN_GetLock(&bufferLock, 1);
+    std::vector<event_buffer_t *> buffers;
+    buffers.swap(fullBuffers);
+    PIN_SemaphoreClear(&buffersFull);
+    PIN_ReleaseLock(&bufferLock);
+
+    for (size_t i = 0; i < buffers.size(); i++){
+        writeEvents(buffers[i]);
+    }
+
+    PIN_GetLock(&bufferLock, 1);
+    freeBuffers.insert(freeBuffers.end(), buffers.begin(), buffers.end());
+    PIN_ReleaseLock(&bufferLock);
+}
+
+// Queues the buffer of a thread for writing and gives the thread an empty
+// one; a new buffer is allocated rather than waiting for the writer
+VOID queueEvents(thread_data_t *tdata, THREADID tid)
+{
+    PIN_GetLock(&bufferLock, tid + 1);
+    if (tdata->events != 0){
+        fullBuffers.push_back(tdata->events);
+    }
+    if (freeBuffers.empty()){
+        tdata->events = new event_buffer_t;
+        tdata->events->size = 0;
+    }
+    else{
+        tdata->events = freeBuffers.back();
+        freeBuffers.pop_back();
+    }
+    tdata->events->owner = tdata;
+    tdata->events->last = false;
+    PIN_ReleaseLock(&bufferLock);
+    PIN_SemaphoreSet(&buffersFull);
+}
+
+// Writes everything traced so far: the queued buffers, then what each
+// thread has in its own buffer. Only called when the application threads
+// are stopped or gone.
+VOID flushEvents()
+{
+    PIN_GetLock(&writeLock, 1);
+    writeFullBuffers();
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        if (threads[i]->events != 0){
+            writeEvents(threads[i]->events);
+        }
+    }
+    PIN_ReleaseLock(&threadLock);
+    PIN_ReleaseLock(&writeLock);
+}
+
+// internal thread formatting the full buffers
+VOID writerThread(VOID *v)
+{
+    while (!writerExit){
+        if (!PIN_SemaphoreTimedWait(&buffersFull, 100)){
+            continue;
+        }
+        PIN_GetLock(&writeLock, 1);
+        writeFullBuffers();
+        PIN_ReleaseLock(&writeLock);
+    }
+    PIN_ExitThread(0);
+}
+
+// the writer must be gone before Fini() writes the rest
+VOID stopWriter(VOID *v)
+{
+    writerExit = true;
+    PIN_SemaphoreSet(&buffersFull);
+    PIN_WaitForThreadTermination(writerUid, PIN_INFINITE_TIMEOUT, 0);
+}
+
+// appends an event to the buffer of a thread, which is queued when full
+VOID pushEvent(thread_data_t *tdata, THREADID tid, UINT32 routineId, ADDRINT argZero, INT32 depth)
+{
+    event_t &event = tdata->events->events[tdata->events->size++];
+    event.routineId = routineId;
+    event.depth = depth;
+    event.argZero = argZero;
+    event.count = tdata->count;
+    if (tdata->events->size == EVENT_BUFFER_SIZE){
+        queueEvents(tdata, tid);
+    }
+}
+
+// records a routine entry; the name is only looked up when it is written.
+// -streams: every -stream_anchor entries are preceded by an anchor, which
+// lets call_graph_merge turn instruction counts into time
+VOID recordEvent(thread_data_t *tdata, THREADID tid, UINT32 routineId, ADDRINT argZero, INT32 depth)
+{
+    if (KnobStreams && tdata->sinceAnchor++ % KnobStreamAnchor == 0){
+        pushEvent(tdata, tid, INVALID_RTN_ID, readTsc(), 0);
+    }
+    pushEvent(tdata, tid, routineId, argZero, depth);
+}
+
+// -streams: closes the stream of a thread whose entries, up to a last
+// anchor, have all been written; caller holds writeLock
+VOID closeStream(thread_data_t *tdata)
+{
+    if (tdata->stream != 0){
+        fclose(tdata->stream);
+        tdata->stream = 0;
     }
 }
 
 /* ===================================================================== */
 // A callback function executed at runtime before executing first
 // instruction in a function
-void executeBeforeRoutine(ADDRINT ip, ADDRINT argZero)
+void executeBeforeRoutine(UINT32 routineId, ADDRINT argZero, THREADID tid, ADDRINT sp, BOOL timed)
 {
     // Check if main function is called
     // If so then set foundMain to true
-    routineName = (RTN_FindNameByAddress(ip));
-    if (routineName.compare("main") == 0){
+    if (routineId == RTN_ID_MAIN){
         foundMain=true;
     }    
     
@@ -90,55 +1024,304 @@ void executeBeforeRoutine(ADDRINT ip, ADDRINT argZero)
     }
 
     //COS375: Add your code here
-    
-    // prints the appropriate number of spaces based on depth, prints routine name
-    // and 1st argument in hex
-    for (int i = 0; i < currentDepth; i++){
-        fprintf(outFile, " ");
+    // the depth is the number of routines on this thread's shadow stack
+    thread_data_t *tdata = threadData[tid];
+    unwindFrames(tdata, sp);
+    if (KnobCct){
+        enterContext(tdata, routineId);
     }
-    fprintf(outFile, "%s(0x%lx,...)\n", routineName.c_str(), argZero);
+    else if (foldedStacks){
+        pushStack(tdata, routineId);
+    }
+    else if (KnobEdges){
+        // counted at the call sites
+    }
+    else if (KnobLatency){
+        // recorded when the frame is popped
+    }
+    else if (KnobMemo){
+        // recorded by executeMemoEntry
+    }
+    else if (KnobIndirect){
+        // counted at the sites
+    }
+    else if (KnobInline){
+        // counted at the call sites and when the frame is popped
+    }
+    else{
+        recordEvent(tdata, tid, routineId, argZero, tdata->frames.Depth());
+    }
+    tdata->frames.Push(sp, routineId, tdata->count, timed ? readTsc() : 0);
 
     // Check if exit function is called
-    if(routineName.compare("exit") == 0){
+    if(routineId == RTN_ID_EXIT){
         foundMain=false;
     }
 }
 
 /* ===================================================================== */
-// Function executed everytime a new routine is found
-VOID Routine(RTN rtn, VOID *v)
+// Instrumentation of the routine's first instruction, ins
+VOID InstrumentRoutineHead(INS ins, UINT32 routineId)
 {
-    RTN_Open(rtn);
     //Insert callback to function executeBeforeRoutine which will be 
     //executed just before executing first instruction in the routine
     //at runtime
     // added paramater (IARG_FUNCARG_ENTRYPOINT_VALUE) to call-back to print 1st arg
-    INS_InsertCall(RTN_InsHead(rtn), IPOINT_BEFORE, (AFUNPTR)executeBeforeRoutine, 
-        IARG_INST_PTR, IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
+    // the routine is identified by its interned id; the stack pointer
+    // identifies its frame
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)executeBeforeRoutine, 
+        IARG_UINT32, routineId, IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_THREAD_ID,
+        IARG_REG_VALUE, REG_STACK_PTR, IARG_BOOL, timedRoutine(routineId), IARG_END);
+
+    if (KnobMemo){
+        IARGLIST args = IARGLIST_Alloc();
+        for (UINT32 i = 0; i < MAX_MEMO_ARGS; i++){
+            if (i < KnobMemoArgs){
+                IARGLIST_AddArguments(args, IARG_FUNCARG_ENTRYPOINT_VALUE, i, IARG_END);
+            }
+            else{
+                IARGLIST_AddArguments(args, IARG_ADDRINT, (ADDRINT)0, IARG_END);
+            }
+        }
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)executeMemoEntry, IARG_THREAD_ID,
+            IARG_UINT32, routineId, IARG_IARGLIST, args, IARG_END);
+        IARGLIST_Free(args);
+    }
+}
+
+// Instrumentation of every instruction of a routine
+VOID InstrumentInstruction(INS ins)
+{
+    //COS375: Add your code here
+    if (KnobCct || foldedByInstructions || KnobLatency || KnobMemo || KnobInline || KnobStreams){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)countInstruction, IARG_FAST_ANALYSIS_CALL,
+            IARG_THREAD_ID, IARG_END);
+    }
+    if ((KnobEdges || KnobInline) && INS_IsCall(ins)){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)countEdge, IARG_THREAD_ID,
+            IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_END);
+    }
+    // returns are indirect too, but their targets are the callers
+    if (KnobIndirect && INS_IsIndirectControlFlow(ins) && !INS_IsRet(ins)){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)countIndirect, IARG_THREAD_ID,
+            IARG_UINT32, indirectSiteId(ins), IARG_BRANCH_TARGET_ADDR, IARG_END);
+    }
+    // inserts callback to executeAtReturn for each exit/return instruction,
+    // which pops the shadow stack down to the returning frame
+    if (INS_IsRet(ins)){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)executeAtReturn,
+            IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+    }
+}
+
+/* ===================================================================== */
+// Function executed everytime a new routine is found
+VOID Routine(RTN rtn, VOID *v)
+{
+    if (KnobInline){
+        recordRoutineSize(rtn);
+    }
+
+    // with -ff routines are instrumented per trace
+    if (fastForward.Enabled()){
+        return;
+    }
+
+    RTN_Open(rtn);
+    InstrumentRoutineHead(RTN_InsHead(rtn), rtnTable.Intern(rtn));
 
     //Iterate over all instructions of routne rtn
     for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)){
-        //COS375: Add your code here
+        InstrumentInstruction(ins);
+    }
+    RTN_Close(rtn);
+}
+
+// Function executed everytime a new trace is found (-ff only); the routine
+// instrumentation is done here so that it appears once fast-forwarding has
+// ended
+VOID Trace(TRACE trace, VOID *v)
+{
+    if (fastForward.InstrumentTrace(trace)){
+        return;
+    }
 
-        // inserts callback to incrementDepth for each function call instruction
-        if (INS_IsCall(ins)){
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)incrementDepth, IARG_END);
+    RTN rtn = TRACE_Rtn(trace);
+    if (!RTN_Valid(rtn)){
+        return;
+    }
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)){
+            if (INS_Address(ins) == RTN_Address(rtn)){
+                InstrumentRoutineHead(ins, rtnTable.Intern(rtn));
+            }
+            InstrumentInstruction(ins);
         }
-        // inserts callback to decrementDepth for each exit/return instruction
-        if (INS_IsRet(ins)){
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)decrementDepth,
-                IARG_INST_PTR, IARG_END);
+    }
+}
+
+// -ff: tracing starts where fast-forwarding ends, which is after main; the
+// depth is counted from there
+VOID FastForwardEnd()
+{
+    foundMain = true;
+}
+
+/* ===================================================================== */
+// Allocates the tree of a new thread
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    thread_data_t *tdata = new thread_data_t(tid);
+    queueEvents(tdata, tid);
+    if (KnobStreams){
+        tdata->stream = fopen(("call_graph." + decstr(tid) + ".out").c_str(), "w");
+        if (tdata->stream != 0){
+            fprintf(tdata->stream, "thread %u\n", tid);
         }
     }
-    RTN_Close(rtn);
+    threadData[tid] = tdata;
+    PIN_GetLock(&threadLock, tid + 1);
+    threads.push_back(tdata);
+    PIN_ReleaseLock(&threadLock);
+}
+
+// Queues what an exiting thread has traced (-streams: ended by a last
+// anchor, after which the writer closes the stream)
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    thread_data_t *tdata = threadData[tid];
+    if (KnobStreams){
+        pushEvent(tdata, tid, INVALID_RTN_ID, readTsc(), 0);
+        tdata->events->last = true;
+    }
+    PIN_GetLock(&bufferLock, tid + 1);
+    fullBuffers.push_back(tdata->events);
+    tdata->events = 0;
+    PIN_ReleaseLock(&bufferLock);
+    PIN_SemaphoreSet(&buffersFull);
+}
+
+// -compress: writes the compressed trace of every thread; caller holds
+// writeLock
+VOID writeCompressed(FILE *out)
+{
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        fprintf(out, "thread %u\n", threads[i]->tid);
+        threads[i]->compressed.Write(out, rtnTable);
+    }
+    PIN_ReleaseLock(&threadLock);
+}
+
+/* ===================================================================== */
+// Snapshot callback. The output is written as it is produced, so the
+// snapshot flushes it and records its length (where the call tree traced
+// so far ends) and the current depth of every thread (-streams: the
+// length of every stream). -compress and the other modes write their
+// results so far instead.
+VOID writeSnapshot(FILE *out)
+{
+    if (KnobCct){
+        writeTrees(out);
+        return;
+    }
+    if (foldedStacks){
+        writeFolded(out);
+        return;
+    }
+    if (KnobEdges){
+        writeEdges(out, 0);
+        return;
+    }
+    if (KnobLatency){
+        writeLatency(out);
+        return;
+    }
+    if (KnobMemo){
+        writeMemo(out);
+        return;
+    }
+    if (KnobIndirect){
+        writeIndirect(out);
+        return;
+    }
+    if (KnobInline){
+        writeInline(out);
+        return;
+    }
+    flushEvents();
+    if (KnobCompress){
+        PIN_GetLock(&writeLock, 1);
+        writeCompressed(out);
+        PIN_ReleaseLock(&writeLock);
+        return;
+    }
+    if (KnobStreams){
+        PIN_GetLock(&writeLock, 1);
+        PIN_GetLock(&threadLock, 1);
+        for (size_t i = 0; i < threads.size(); i++){
+            if (threads[i]->stream != 0){
+                fflush(threads[i]->stream);
+                fprintf(out, "call_graph.%u.out:%ld\n", threads[i]->tid, ftell(threads[i]->stream));
+            }
+        }
+        PIN_ReleaseLock(&threadLock);
+        PIN_ReleaseLock(&writeLock);
+        return;
+    }
+    fflush(outFile);
+    fprintf(out, "call_graph.out:%ld\n", ftell(outFile));
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        fprintf(out, "depth:%u:%lu\n", threads[i]->tid, threads[i]->frames.Depth());
+    }
+    PIN_ReleaseLock(&threadLock);
 }
 
 /* ===================================================================== */
 // Function executed after instrumentation
-// All function data printed as it is encountered, so no data printed in Fini
+// Function data is written as it is encountered, Fini only flushes the
+// entries still buffered (-cct, -folded, -edges, -latency, -memo,
+// -indirect, -inline, -compress: writes their results; -streams: closes the streams
+// of the threads still running)
 VOID Fini(INT32 code, VOID *v)
 {
     //COS375: Add your code here to dump instrumentation data that is collected.
+    if (KnobCct){
+        writeTrees(outFile);
+    }
+    else if (foldedStacks){
+        writeFolded(outFile);
+    }
+    else if (KnobEdges){
+        FILE *dot = fopen("call_graph.dot", "w");
+        writeEdges(outFile, dot);
+        if (dot != 0){
+            fclose(dot);
+        }
+    }
+    else if (KnobLatency){
+        writeLatency(outFile);
+    }
+    else if (KnobMemo){
+        writeMemo(outFile);
+    }
+    else if (KnobIndirect){
+        writeIndirect(outFile);
+    }
+    else if (KnobInline){
+        writeInline(outFile);
+    }
+    flushEvents();
+    if (KnobCompress){
+        writeCompressed(outFile);
+    }
+    for (size_t i = 0; KnobStreams && i < threads.size(); i++){
+        if (threads[i]->stream != 0){
+            fprintf(threads[i]->stream, "a %lu %lu\n", threads[i]->count, readTsc());
+            closeStream(threads[i]);
+        }
+    }
     fprintf(outFile,"COS375 pin tool Template");
     fclose(outFile);
 }
@@ -156,9 +1339,42 @@ int main(int argc, char *argv[])
         return Usage();
     }
 
+    if (!KnobFolded.Value().empty()){
+        if (KnobFolded.Value() != "calls" && KnobFolded.Value() != "instructions"){
+            return Usage();
+        }
+        foldedStacks = true;
+        foldedByInstructions = KnobFolded.Value() == "instructions";
+    }
+    if (KnobMemoArgs > MAX_MEMO_ARGS || (KnobStreams && (KnobCompress || KnobStreamAnchor == 0))){
+        return Usage();
+    }
+    // every mode replaces the call trace, and Fini writes only one of them
+    UINT32 modes = KnobCct + foldedStacks + KnobEdges + KnobLatency + KnobMemo + KnobIndirect + KnobInline;
+    if (modes > 1 || (modes == 1 && (KnobStreams || KnobCompress))){
+        cerr << "-cct, -folded, -edges, -latency, -memo, -indirect, -inline, -streams and -compress "
+                "are mutually exclusive" << endl;
+        return Usage();
+    }
+
     outFile = fopen("call_graph.out","w");
+    PIN_InitLock(&threadLock);
+    PIN_InitLock(&bufferLock);
+    PIN_InitLock(&writeLock);
+    PIN_SemaphoreInit(&buffersFull);
+    if (PIN_SpawnInternalThread(writerThread, 0, 0, &writerUid) == INVALID_THREADID){
+        cerr << "cannot start the writer thread" << endl;
+        return -1;
+    }
+    PIN_AddPrepareForFiniFunction(stopWriter, 0);
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
     RTN_AddInstrumentFunction(Routine, 0);
+    if (fastForward.Activate(FastForwardEnd)){
+        TRACE_AddInstrumentFunction(Trace, 0);
+    }
     PIN_AddFiniFunction(Fini, 0);
+    snapshot.Activate("call_graph.out", writeSnapshot);
 
     // Never returns
     PIN_StartProgram();
@@ -0,0 +1,182 @@
+/*! @file
+ *  Expands the trace written by call_graph -compress back into the plain
+ *  call_graph trace, one routine entry per line indented by depth.
+ *
+ *  Within a thread's section every line is a record:
+ *      name(0xarg,...)           written as is
+ *      name x N, depth d..e      N nested entries of name at depths d to e;
+ *                                their arguments were not kept ("?")
+ *      name @L                   the subtree of the section's L-th record,
+ *                                moved to this record's depth
+ *      name x N                  N entries of name without callees
+ *      name @L x N               N copies of the subtree of record L
+ *  Other lines ("thread N", the trailer) are copied.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+
+using std::vector;
+using std::string;
+using std::cerr;
+using std::endl;
+
+struct RECORD
+{
+    enum { ENTRY, RUN, COPY } kind;
+    long depth;
+    string text;        // ENTRY: the line without indentation, else the name
+    unsigned long count;    // RUN: number of entries
+    unsigned long target;   // COPY: index of the copied record
+    unsigned long repeat;   // ENTRY, COPY: times it occurs back to back
+};
+
+int Usage()
+{
+    cerr <<
+        "Usage: call_graph_expand [<call_graph.out>]\n"
+        "Writes the plain call trace of a call_graph -compress output to stdout.\n";
+    return 1;
+}
+
+static void Indent(long depth)
+{
+    for (long i = 0; i < depth; i++){
+        fputc(' ', stdout);
+    }
+}
+
+// Parses line as a record, false if it is not one
+static bool Parse(const string &line, RECORD &record)
+{
+    size_t start = line.find_first_not_of(' ');
+    if (start == string::npos || line.compare(start, 7, "thread ") == 0 || line.compare(start, 6, "COS375") == 0){
+        return false;
+    }
+    record.depth = start;
+    record.repeat = 1;
+    string rest = line.substr(start);
+
+    // repetition of a leaf or of a copy
+    size_t x = rest.rfind(" x ");
+    if (x != string::npos && x + 3 < rest.size() && rest.find_first_not_of("0123456789", x + 3) == string::npos){
+        record.repeat = strtoul(rest.c_str() + x + 3, 0, 10);
+        rest.erase(x);
+        if (rest.find(" @") == string::npos){
+            record.kind = RECORD::ENTRY;
+            record.text = rest + "(?,...)";
+            return record.repeat > 0;
+        }
+    }
+
+    size_t at = rest.rfind(" @");
+    if (at != string::npos && rest.find_first_not_of("0123456789", at + 2) == string::npos && at + 2 < rest.size()){
+        record.kind = RECORD::COPY;
+        record.text = rest.substr(0, at);
+        record.target = strtoul(rest.c_str() + at + 2, 0, 10);
+        return record.target > 0;
+    }
+
+    x = rest.rfind(" x ");
+    long first, last;
+    unsigned long count;
+    char tail;
+    if (x != string::npos && sscanf(rest.c_str() + x, " x %lu, depth %ld..%ld%c", &count, &first, &last, &tail) == 3){
+        record.kind = RECORD::RUN;
+        record.text = rest.substr(0, x);
+        record.count = count;
+        return true;
+    }
+
+    record.kind = RECORD::ENTRY;
+    record.text = rest;
+    return true;
+}
+
+// index after the subtree rooted at record i
+static size_t SubtreeEnd(const vector<RECORD> &records, size_t i)
+{
+    size_t end = i + 1;
+    while (end < records.size() && records[end].depth > records[i].depth){
+        end++;
+    }
+    return end;
+}
+
+// Writes records [begin, end), moved down by shift levels
+static void Expand(const vector<RECORD> &records, size_t begin, size_t end, long shift)
+{
+    for (size_t i = begin; i < end; i++){
+        const RECORD &record = records[i];
+        long depth = record.depth + shift;
+        if (record.kind == RECORD::ENTRY){
+            for (unsigned long n = 0; n < record.repeat; n++){
+                Indent(depth);
+                printf("%s\n", record.text.c_str());
+            }
+        }
+        else if (record.kind == RECORD::RUN){
+            for (unsigned long n = 0; n < record.count; n++){
+                Indent(depth + n);
+                printf("%s(?,...)\n", record.text.c_str());
+            }
+        }
+        else{
+            // copies only refer back, so this terminates
+            size_t target = record.target - 1;
+            for (unsigned long n = 0; n < record.repeat; n++){
+                Expand(records, target, SubtreeEnd(records, target), depth - records[target].depth);
+            }
+        }
+    }
+}
+
+// Expands one thread's section and checks that its copies refer back
+static bool ExpandSection(vector<RECORD> &records)
+{
+    for (size_t i = 0; i < records.size(); i++){
+        if (records[i].kind == RECORD::COPY && records[i].target > i){
+            cerr << "call_graph_expand: record " << i + 1 << " copies record " << records[i].target << endl;
+            return false;
+        }
+    }
+    Expand(records, 0, records.size(), 0);
+    records.clear();
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')){
+        return Usage();
+    }
+    std::ifstream file;
+    if (argc == 2){
+        file.open(argv[1]);
+        if (!file){
+            cerr << "call_graph_expand: cannot read " << argv[1] << endl;
+            return 1;
+        }
+    }
+    std::istream &in = argc == 2 ? file : std::cin;
+
+    vector<RECORD> records;
+    string line;
+    while (std::getline(in, line)){
+        RECORD record;
+        if (Parse(line, record)){
+            records.push_back(record);
+            continue;
+        }
+        if (!ExpandSection(records)){
+            return 1;
+        }
+        printf("%s\n", line.c_str());
+    }
+    return ExpandSection(records) ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+/*! @file
+ *  Merges the per-thread streams written by call_graph -streams
+ *  (call_graph.<tid>.out) into one call trace.
+ *
+ *  A stream starts with "thread N" and then has two kinds of lines:
+ *      a <count> <tsc>                  time stamp counter anchor
+ *      e <count> <depth> 0xarg name     routine entry
+ *  where count is the number of instructions the thread had executed. The
+ *  time of an entry is interpolated from its count between the anchors
+ *  around it, so the streams are only read ahead up to the next anchor.
+ *  The time stamp counters of all cores are assumed to be synchronized.
+ *
+ *  By default the entries of all threads are written in time order as
+ *      <tsc> <tid> <indentation by depth>name(0xarg,...)
+ *  With -t every stream is written after the other as "thread N" and the
+ *  plain call_graph trace of that thread.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <string>
+#include <fstream>
+#include <iostream>
+
+using std::vector;
+using std::deque;
+using std::string;
+using std::cerr;
+using std::endl;
+
+struct EVENT
+{
+    unsigned long count;
+    unsigned long time;
+    long depth;
+    string text;    // name(0xarg,...)
+};
+
+struct STREAM
+{
+    std::ifstream in;
+    string name;
+    unsigned long tid;
+    bool anchored;          // an anchor has been read
+    unsigned long anchorCount;
+    unsigned long anchorTime;
+    vector<EVENT> pending;  // entries after the last anchor
+    deque<EVENT> ready;     // entries with a time, in order
+    bool done;
+};
+
+int Usage()
+{
+    cerr <<
+        "Usage: call_graph_merge [-t] <call_graph.<tid>.out>...\n"
+        "Writes the entries of the call_graph -streams files to stdout, ordered by\n"
+        "time, or one thread after the other with -t.\n";
+    return 1;
+}
+
+// Gives the pending entries their times, up to an anchor at count/time
+static void Release(STREAM &stream, unsigned long count, unsigned long time)
+{
+    for (size_t i = 0; i < stream.pending.size(); i++){
+        EVENT &event = stream.pending[i];
+        event.time = time;
+        if (stream.anchored && count > stream.anchorCount && time > stream.anchorTime){
+            double share = (double)(event.count - stream.anchorCount) / (count - stream.anchorCount);
+            event.time = stream.anchorTime + (unsigned long)(share * (time - stream.anchorTime));
+        }
+        stream.ready.push_back(event);
+    }
+    stream.pending.clear();
+}
+
+// Reads stream until it has an entry ready or ends; false on a bad line
+static bool Fill(STREAM &stream)
+{
+    string line;
+    while (stream.ready.empty() && !stream.done){
+        if (!std::getline(stream.in, line)){
+            // entries after the last anchor get its time
+            Release(stream, stream.anchorCount, stream.anchorTime);
+            stream.done = true;
+            break;
+        }
+        unsigned long count, time;
+        long depth;
+        char arg[32];
+        int length;
+        if (sscanf(line.c_str(), "a %lu %lu", &count, &time) == 2){
+            Release(stream, count, time);
+            stream.anchored = true;
+            stream.anchorCount = count;
+            stream.anchorTime = time;
+        }
+        else if (sscanf(line.c_str(), "e %lu %ld %31s %n", &count, &depth, arg, &length) == 3){
+            EVENT event;
+            event.count = count;
+            event.time = 0;
+            event.depth = depth > 0 ? depth : 0;
+            event.text = line.substr(length) + "(" + arg + ",...)";
+            stream.pending.push_back(event);
+        }
+        else{
+            cerr << "call_graph_merge: " << stream.name << ": bad line: " << line << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// -t: writes one stream as the plain trace of its thread
+static bool WriteThread(STREAM &stream)
+{
+    printf("thread %lu\n", stream.tid);
+    while (Fill(stream) && !stream.ready.empty()){
+        const EVENT &event = stream.ready.front();
+        printf("%*s%s\n", (int)event.depth, "", event.text.c_str());
+        stream.ready.pop_front();
+    }
+    return stream.done;
+}
+
+// writes the entries of all streams, earliest first
+static bool WriteMerged(vector<STREAM *> &streams)
+{
+    for (size_t i = 0; i < streams.size(); i++){
+        if (!Fill(*streams[i])){
+            return false;
+        }
+    }
+    for (;;){
+        STREAM *first = 0;
+        for (size_t i = 0; i < streams.size(); i++){
+            if (!streams[i]->ready.empty() && (first == 0 || streams[i]->ready.front().time < first->ready.front().time)){
+                first = streams[i];
+            }
+        }
+        if (first == 0){
+            return true;
+        }
+        const EVENT &event = first->ready.front();
+        printf("%lu %lu %*s%s\n", event.time, first->tid, (int)event.depth, "", event.text.c_str());
+        first->ready.pop_front();
+        if (!Fill(*first)){
+            return false;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool perThread = argc > 1 && strcmp(argv[1], "-t") == 0;
+    int firstFile = perThread ? 2 : 1;
+    if (firstFile >= argc){
+        return Usage();
+    }
+
+    vector<STREAM *> streams;
+    for (int i = firstFile; i < argc; i++){
+        STREAM *stream = new STREAM;
+        stream->name = argv[i];
+        stream->in.open(argv[i]);
+        string header;
+        if (!stream->in || !std::getline(stream->in, header) || sscanf(header.c_str(), "thread %lu", &stream->tid) != 1){
+            cerr << "call_graph_merge: " << argv[i] << " is not a call_graph stream" << endl;
+            return 1;
+        }
+        stream->anchored = false;
+        stream->anchorCount = 0;
+        stream->anchorTime = 0;
+        stream->done = false;
+        streams.push_back(stream);
+    }
+
+    if (!perThread){
+        return WriteMerged(streams) ? 0 : 1;
+    }
+    for (size_t i = 0; i < streams.size(); i++){
+        if (!WriteThread(*streams[i])){
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2002-2020 Intel Corporation.
+ *
+ * This software is provided to you as Sample Source Code as defined in the accompanying
+ * End User License Agreement for the Intel(R) Software Development Products ("Agreement")
+ * section 1.L.
+ *
+ * This software and the related documents are provided as is, with no express or implied
+ * warranties, other than those that are expressly stated in the License.
+ */
+
+/*! @file
+ *  Probe mode variant of call_graph: counts the entries of selected routines
+ *  and keeps the first argument of their first calls. Only the entries of
+ *  the selected routines are patched, the application otherwise runs
+ *  natively. Routines are counted by name, so the copies of a routine in
+ *  different images share their counters.
+ */
+
+#include "pin.H"
+#include <iostream>
+#include <string.h>
+#include <regex.h>
+#include <vector>
+#include "rtn_table.h"
+using std::cerr;
+using std::endl;
+using std::string;
+
+/* ===================================================================== */
+/* Global Variables */
+/* ===================================================================== */
+
+// interned routine names; the probes only see the slot of their routine
+RTN_TABLE rtnTable;
+FILE *outFile;
+
+// Counters of one probed routine. The table is allocated before the
+// application starts and never grows, so probes never allocate or lock.
+#define MAX_ARGS 64
+struct probe_slot_t
+{
+    UINT32 routineId;
+    UINT64 count;
+    ADDRINT args[MAX_ARGS]; // first argument of the first calls
+};
+probe_slot_t *slots;
+UINT32 numSlots = 0;
+std::vector<UINT32> slotOfRoutine;  // by routine id, NO_SLOT if not probed
+
+const UINT32 NO_SLOT = ~0u;
+
+// compiled -rtn_regex, if any
+regex_t rtnRegex;
+bool haveRegex = false;
+
+/* ===================================================================== */
+/* Commandline Switches */
+/* ===================================================================== */
+
+KNOB<string> KnobRoutines(KNOB_MODE_APPEND, "pintool",
+    "rtn", "", "routine to probe (may be repeated)");
+KNOB<string> KnobRoutineRegex(KNOB_MODE_WRITEONCE, "pintool",
+    "rtn_regex", "", "probe every routine whose name matches this extended regular expression");
+KNOB<UINT32> KnobMaxRoutines(KNOB_MODE_WRITEONCE, "pintool",
+    "max_rtns", "1024", "size of the preallocated table; further routines are not probed");
+KNOB<UINT32> KnobArgs(KNOB_MODE_WRITEONCE, "pintool",
+    "args", "8", "number of calls per routine whose first argument is kept (at most 64)");
+
+/* ===================================================================== */
+/* Print Help Message                                                    */
+/* ===================================================================== */
+
+INT32 Usage()
+{
+    cerr <<
+        "This tool counts the calls of selected routines in probe mode.\n"
+        "\n";
+
+    cerr << KNOB_BASE::StringKnobSummary();
+
+    cerr << endl;
+
+    return -1;
+}
+
+/* ===================================================================== */
+// Probe executed on entry to a selected routine
+VOID executeBeforeRoutine(UINT32 slot, ADDRINT argZero)
+{
+    probe_slot_t &entry = slots[slot];
+    UINT64 call = __sync_fetch_and_add(&entry.count, 1);
+    if (call < KnobArgs.Value()){
+        entry.args[call] = argZero;
+    }
+}
+
+// prints name:calls:0xarg,0xarg,... for every probed routine that was called
+VOID writeOutput(FILE *out)
+{
+    UINT32 numArgs = KnobArgs.Value();
+    for (UINT32 i = 0; i < numSlots; i++){
+        probe_slot_t &entry = slots[i];
+        if (entry.count == 0){
+            continue;
+        }
+        fprintf(out, "%s:%lu:", rtnTable.Name(entry.routineId).c_str(), entry.count);
+        for (UINT32 a = 0; a < entry.count && a < numArgs; a++){
+            fprintf(out, "%s0x%lx", a ? "," : "", entry.args[a]);
+        }
+        fprintf(out, "\n");
+    }
+    fclose(out);
+}
+
+// Probe executed on entry to exit(), _exit() and _Exit(); Fini functions
+// are not available in probe mode, so the output is written here. The
+// probes of _exit() and _Exit() catch processes that end without exit();
+// exit() itself ends in _exit(), so only the first probe writes.
+VOID executeBeforeExit(UINT32 slot, ADDRINT argZero)
+{
+    if (slot != NO_SLOT){
+        executeBeforeRoutine(slot, argZero);
+    }
+    FILE *out = __sync_lock_test_and_set(&outFile, (FILE *)0);
+    if (out){
+        writeOutput(out);
+    }
+}
+
+/* ===================================================================== */
+// is rtn one of the routines to probe?
+bool selected(const string &name)
+{
+    for (UINT32 i = 0; i < KnobRoutines.NumberOfValues(); i++){
+        if (KnobRoutines.Value(i) == name){
+            return true;
+        }
+    }
+    return haveRegex && regexec(&rtnRegex, name.c_str(), 0, 0, 0) == 0;
+}
+
+// Function executed for every image loaded; probes the selected routines
+VOID Image(IMG img, VOID *v)
+{
+    for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)){
+        for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn)){
+            string name = RTN_Name(rtn);
+            bool isExit = name == "exit" || name == "_exit" || name == "_Exit";
+            UINT32 slot = NO_SLOT;
+            bool newSlot = false;
+            if (selected(name)){
+                UINT32 routineId = rtnTable.Intern(name);
+                if (routineId >= slotOfRoutine.size()){
+                    slotOfRoutine.resize(routineId + 1, NO_SLOT);
+                }
+                slot = slotOfRoutine[routineId];
+                newSlot = slot == NO_SLOT && numSlots < KnobMaxRoutines.Value();
+                if (newSlot){
+                    slot = numSlots;
+                    slots[slot].routineId = routineId;
+                }
+            }
+            if ((slot == NO_SLOT && !isExit) || !RTN_IsSafeForProbedInsertion(rtn)){
+                if (slot != NO_SLOT){
+                    LOG("call_graph_probe: cannot probe " + name + " in " + IMG_Name(img) + "\n");
+                }
+                continue;
+            }
+            if (newSlot){
+                slotOfRoutine[slots[slot].routineId] = slot;
+                numSlots++;
+            }
+            RTN_InsertCallProbed(rtn, IPOINT_BEFORE,
+                isExit ? (AFUNPTR)executeBeforeExit : (AFUNPTR)executeBeforeRoutine,
+                IARG_UINT32, slot, IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
+        }
+    }
+}
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+int main(int argc, char *argv[])
+{
+    PIN_InitSymbols();
+    if( PIN_Init(argc,argv) )
+    {
+        return Usage();
+    }
+    if (KnobArgs.Value() > MAX_ARGS){
+        return Usage();
+    }
+    if (!KnobRoutineRegex.Value().empty()){
+        if (regcomp(&rtnRegex, KnobRoutineRegex.Value().c_str(), REG_EXTENDED | REG_NOSUB) != 0){
+            cerr << "invalid -rtn_regex " << KnobRoutineRegex.Value() << endl;
+            return -1;
+        }
+        haveRegex = true;
+    }
+
+    outFile = fopen("call_graph_probe.out","w");
+    slots = static_cast<probe_slot_t *>(calloc(KnobMaxRoutines.Value(), sizeof(probe_slot_t)));
+    IMG_AddInstrumentFunction(Image, 0);
+
+    // Never returns
+    PIN_StartProgramProbed();
+
+    return 0;
+}
+
+/* ===================================================================== */
+/* eof */
+/* ===================================================================== */
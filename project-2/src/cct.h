@@ -0,0 +1,124 @@
+/*! @file
+ *  Calling context tree used by call_graph -cct.
+ *
+ *  Every node is one distinct calling context: a routine id reached
+ *  through a particular chain of callers. A node counts how often the
+ *  context was entered and how many instructions were executed in it
+ *  (callees excluded). Children are kept in a small open-addressed table
+ *  keyed by routine id, so entering a known context costs one hash probe
+ *  and no allocation; the table doubles when it gets three quarters full.
+ *  Each tree is owned and updated by a single thread.
+ */
+#ifndef CCT_H
+#define CCT_H
+
+#include "pin.H"
+#include <stdio.h>
+#include <vector>
+#include <utility>
+#include "rtn_table.h"
+
+class CCT_NODE
+{
+  public:
+    CCT_NODE(UINT32 routineId, CCT_NODE *parent)
+        : routineId(routineId), parent(parent), calls(0), instructions(0),
+          _capacity(0), _size(0), _slots(0) {}
+
+    ~CCT_NODE()
+    {
+        for (size_t i = 0; i < _order.size(); i++){
+            delete _order[i];
+        }
+        delete[] _slots;
+    }
+
+    UINT32 routineId;
+    CCT_NODE *parent;
+    UINT64 calls;
+    UINT64 instructions; // executed in this context, callees excluded
+
+    // Returns the child for callee routineId, creating it on first use
+    CCT_NODE *Child(UINT32 id)
+    {
+        if (_capacity != 0){
+            for (UINT32 i = Hash(id) & (_capacity - 1); _slots[i] != 0; i = (i + 1) & (_capacity - 1)){
+                if (_slots[i]->routineId == id){
+                    return _slots[i];
+                }
+            }
+        }
+        if (4 * (_size + 1) > 3 * _capacity){
+            Grow();
+        }
+        CCT_NODE *child = new CCT_NODE(id, this);
+        Insert(child);
+        _order.push_back(child);
+        _size++;
+        return child;
+    }
+
+    // children in the order they were first called
+    const std::vector<CCT_NODE *> &Children() const
+    {
+        return _order;
+    }
+
+    // Writes the subtree below this node, one "name:calls:instructions"
+    // line per context, indented by its depth. Iterative, so deep
+    // recursion in the application does not exhaust the tool's stack.
+    VOID Write(FILE *out, const RTN_TABLE &names) const
+    {
+        std::vector<std::pair<const CCT_NODE *, UINT32> > work;
+        for (size_t i = _order.size(); i > 0; i--){
+            work.push_back(std::make_pair(_order[i - 1], 0u));
+        }
+        while (!work.empty()){
+            const CCT_NODE *node = work.back().first;
+            UINT32 depth = work.back().second;
+            work.pop_back();
+            fprintf(out, "%*s%s:%lu:%lu\n", depth, "", names.Name(node->routineId).c_str(),
+                node->calls, node->instructions);
+            for (size_t i = node->_order.size(); i > 0; i--){
+                work.push_back(std::make_pair(node->_order[i - 1], depth + 1));
+            }
+        }
+    }
+
+  private:
+    UINT32 _capacity; // power of two, 0 until the first child
+    UINT32 _size;
+    CCT_NODE **_slots;
+    std::vector<CCT_NODE *> _order;
+
+    static UINT32 Hash(UINT32 id)
+    {
+        return id * 2654435761u;
+    }
+
+    VOID Insert(CCT_NODE *child)
+    {
+        UINT32 i = Hash(child->routineId) & (_capacity - 1);
+        while (_slots[i] != 0){
+            i = (i + 1) & (_capacity - 1);
+        }
+        _slots[i] = child;
+    }
+
+    VOID Grow()
+    {
+        UINT32 capacity = _capacity ? 2 * _capacity : 4;
+        delete[] _slots;
+        _slots = new CCT_NODE *[capacity]();
+        _capacity = capacity;
+        for (size_t i = 0; i < _order.size(); i++){
+            Insert(_order[i]);
+        }
+    }
+
+    // not copyable
+    CCT_NODE(const CCT_NODE &);
+    CCT_NODE &operator=(const CCT_NODE &);
+};
+
+#endif // CCT_H
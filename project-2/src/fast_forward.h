@@ -0,0 +1,123 @@
+/*! @file
+ *  Fast-forward support shared by the project-2 tools.
+ *
+ *  With -ff <n> a tool skips the first n instructions after main() with
+ *  minimal instrumentation: every basic block only gets one inlined add to
+ *  an instruction counter, and the head of every trace checks the counter
+ *  against the threshold. Once the threshold is crossed all instrumentation
+ *  is removed from the code cache (PIN_RemoveInstrumentation) and execution
+ *  resumes at the same instruction, so every trace is instrumented again,
+ *  this time with the tool's full analysis.
+ *
+ *  Routine instrumentation is applied ahead of time and survives
+ *  PIN_RemoveInstrumentation, so a tool using -ff must do its analysis from
+ *  a TRACE instrumentation function that starts with
+ *
+ *      if (fastForward.InstrumentTrace(trace)) return;
+ *
+ *  The counter is shared by all threads and its adds are not atomic, so with
+ *  several threads the threshold is approximate.
+ */
+#ifndef FAST_FORWARD_H
+#define FAST_FORWARD_H
+
+#include "pin.H"
+#include <string>
+
+KNOB<UINT64> KnobFastForward(KNOB_MODE_WRITEONCE, "pintool",
+    "ff", "0", "skip the first <n> instructions after main with minimal instrumentation");
+
+// called once, at the instruction where fast-forwarding ends
+typedef VOID (*FF_END_CALLBACK)();
+
+class FAST_FORWARD
+{
+  public:
+    FAST_FORWARD() : _count(0), _threshold(0), _mainSeen(0), _enabled(FALSE), _active(FALSE), _onEnd(0) {}
+
+    // Call from main() after PIN_Init(). Returns FALSE if -ff was not given,
+    // in which case the tool instruments as usual.
+    BOOL Activate(FF_END_CALLBACK onEnd)
+    {
+        _threshold = KnobFastForward.Value();
+        _enabled = _threshold > 0;
+        _active = _enabled;
+        _onEnd = onEnd;
+        return _enabled;
+    }
+
+    // -ff was given: the tool's analysis must be inserted per trace
+    BOOL Enabled() const { return _enabled; }
+
+    // still skipping instructions
+    BOOL Active() const { return _active; }
+
+    // instructions counted while fast-forwarding
+    UINT64 Count() const { return _count; }
+
+    // While fast-forwarding, adds the counting instrumentation to trace and
+    // returns TRUE; the tool must then leave the trace alone.
+    BOOL InstrumentTrace(TRACE trace)
+    {
+        if (!_active){
+            return FALSE;
+        }
+
+        INS head = BBL_InsHead(TRACE_BblHead(trace));
+        INS_InsertIfCall(head, IPOINT_BEFORE, (AFUNPTR)Due, IARG_FAST_ANALYSIS_CALL,
+            IARG_PTR, this, IARG_END);
+        INS_InsertThenCall(head, IPOINT_BEFORE, (AFUNPTR)End, IARG_PTR, this, IARG_CONTEXT, IARG_END);
+
+        // instructions are only counted from the entry of main
+        RTN rtn = TRACE_Rtn(trace);
+        if (RTN_Valid(rtn) && RTN_Address(rtn) == TRACE_Address(trace) && RTN_Name(rtn) == "main"){
+            INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)MainSeen, IARG_PTR, this, IARG_END);
+        }
+
+        for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
+            BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountBlock, IARG_FAST_ANALYSIS_CALL,
+                IARG_PTR, this, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+        }
+        return TRUE;
+    }
+
+  private:
+    UINT64 _count;
+    UINT64 _threshold;
+    UINT64 _mainSeen;  // 0 or 1, multiplies the adds
+    BOOL _enabled;
+    volatile BOOL _active;
+    FF_END_CALLBACK _onEnd;
+
+    static VOID PIN_FAST_ANALYSIS_CALL CountBlock(FAST_FORWARD *ff, UINT32 numIns)
+    {
+        ff->_count += numIns * ff->_mainSeen;
+    }
+
+    static ADDRINT PIN_FAST_ANALYSIS_CALL Due(FAST_FORWARD *ff)
+    {
+        return ff->_count >= ff->_threshold;
+    }
+
+    static VOID MainSeen(FAST_FORWARD *ff)
+    {
+        ff->_mainSeen = 1;
+    }
+
+    // Leaves fast-forward mode: flushes the code cache and restarts the
+    // current trace, which is then instrumented by the tool
+    static VOID End(FAST_FORWARD *ff, CONTEXT *ctxt)
+    {
+        if (!ff->_active){
+            return;
+        }
+        ff->_active = FALSE;
+        if (ff->_onEnd){
+            ff->_onEnd();
+        }
+        PIN_RemoveInstrumentation();
+        PIN_ExecuteAt(ctxt);
+    }
+};
+
+#endif // FAST_FORWARD_H
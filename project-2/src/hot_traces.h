@@ -0,0 +1,170 @@
+/*! @file
+ *  Tiered instrumentation shared by mem_trace and insmix.
+ *
+ *  With -hot <n> every trace is first instrumented with a single execution
+ *  counter at its head. When a trace has run n times, its instrumentation
+ *  is removed from the code cache (PIN_RemoveInstrumentationInRange) and
+ *  execution resumes at the same instruction, so the trace is instrumented
+ *  again, this time with the tool's full analysis. Code that runs only a
+ *  few times therefore costs one inlined counter per execution.
+ *
+ *  What cold traces would have contributed is estimated from their
+ *  execution counts: the tool annotates the record of a cold trace with its
+ *  cost per execution (e.g. its memory accesses), and ColdExecutions() /
+ *  ColdWeight() add them up. A trace that leaves early through a side exit
+ *  is counted in full, so the estimates are upper bounds. A tool that only
+ *  counts while a flag is set (e.g. insmix -control) passes the flag to
+ *  Activate(); hot_trace_t::enabledExecutions then only counts the cold
+ *  executions made while it was set. The counters are
+ *  shared by all threads and not atomic, so the threshold is approximate.
+ *
+ *  A tool using -hot does its analysis from a TRACE instrumentation
+ *  function:
+ *
+ *      hot_trace_t *cold = hotTraces.InstrumentTrace(trace);
+ *      if (cold){ cold->weight = ...; }
+ *      else{ ... full analysis ... }
+ */
+#ifndef HOT_TRACES_H
+#define HOT_TRACES_H
+
+#include "pin.H"
+#include <vector>
+#include <unordered_map>
+
+KNOB<UINT64> KnobHot(KNOB_MODE_WRITEONCE, "pintool",
+    "hot", "0", "only count executions of a trace until it has run <n> times, then instrument it fully");
+
+struct hot_trace_t
+{
+    ADDRINT address;
+    USIZE size;
+    UINT32 numIns;
+    UINT64 weight;      // tool defined cost of one cold execution
+    UINT64 executions;  // cold executions
+    UINT64 enabledExecutions;  // cold executions while the tool's flag was set
+    volatile BOOL hot;
+};
+
+class HOT_TRACES
+{
+  public:
+    HOT_TRACES() : _threshold(0), _enabled(Always()) {}
+
+    // Call from main() after PIN_Init(). Returns FALSE if -hot was not
+    // given, in which case the tool instruments as usual. enabled, if not
+    // 0, is the flag (0 or 1) of the tool that says whether it is counting.
+    BOOL Activate(const volatile UINT32 *enabled = 0)
+    {
+        _enabled = enabled ? enabled : Always();
+        _threshold = KnobHot.Value();
+        return _threshold > 0;
+    }
+
+    BOOL Enabled() const { return _threshold > 0; }
+
+    // While trace is cold, adds its execution counter and returns its
+    // record, and the tool must leave the rest of the trace alone. Returns
+    // 0 once the trace is hot, or without -hot.
+    hot_trace_t *InstrumentTrace(TRACE trace)
+    {
+        if (_threshold == 0){
+            return 0;
+        }
+        ADDRINT address = TRACE_Address(trace);
+        std::unordered_map<ADDRINT, hot_trace_t *>::const_iterator it = _byAddress.find(address);
+        hot_trace_t *record;
+        if (it != _byAddress.end()){
+            record = it->second;
+        }
+        else{
+            record = new hot_trace_t;
+            record->address = address;
+            record->weight = 0;
+            record->executions = 0;
+            record->enabledExecutions = 0;
+            record->hot = FALSE;
+            _byAddress[address] = record;
+            _records.push_back(record);
+        }
+        if (record->hot){
+            return 0;
+        }
+        record->size = TRACE_Size(trace);
+        record->numIns = TRACE_NumIns(trace);
+
+        INS head = BBL_InsHead(TRACE_BblHead(trace));
+        INS_InsertIfCall(head, IPOINT_BEFORE, (AFUNPTR)Tick, IARG_FAST_ANALYSIS_CALL,
+            IARG_PTR, record, IARG_ADDRINT, (ADDRINT)_threshold, IARG_PTR, _enabled, IARG_END);
+        INS_InsertThenCall(head, IPOINT_BEFORE, (AFUNPTR)Promote, IARG_PTR, record, IARG_PTR, _enabled,
+            IARG_CONTEXT, IARG_END);
+        return record;
+    }
+
+    // every trace seen, cold or hot
+    const std::vector<hot_trace_t *> &Traces() const { return _records; }
+
+    UINT64 ColdExecutions() const
+    {
+        UINT64 total = 0;
+        for (size_t i = 0; i < _records.size(); i++){
+            total += _records[i]->executions;
+        }
+        return total;
+    }
+
+    // estimated cost of the cold executions, in the tool's weight units
+    UINT64 ColdWeight() const
+    {
+        UINT64 total = 0;
+        for (size_t i = 0; i < _records.size(); i++){
+            total += _records[i]->executions * _records[i]->weight;
+        }
+        return total;
+    }
+
+    UINT32 NumHot() const
+    {
+        UINT32 hot = 0;
+        for (size_t i = 0; i < _records.size(); i++){
+            hot += _records[i]->hot ? 1 : 0;
+        }
+        return hot;
+    }
+
+  private:
+    UINT64 _threshold;
+    const volatile UINT32 *_enabled;
+
+    // flag of the tools that always count
+    static const volatile UINT32 *Always()
+    {
+        static const volatile UINT32 one = 1;
+        return &one;
+    }
+    std::unordered_map<ADDRINT, hot_trace_t *> _byAddress;
+    std::vector<hot_trace_t *> _records;
+
+    static ADDRINT PIN_FAST_ANALYSIS_CALL Tick(hot_trace_t *record, ADDRINT threshold, const volatile UINT32 *enabled)
+    {
+        record->enabledExecutions += *enabled;
+        return ++record->executions >= threshold;
+    }
+
+    // The trace has become hot: drops its counter from the code cache and
+    // restarts it, so that it is instrumented again with the analysis
+    static VOID Promote(hot_trace_t *record, const volatile UINT32 *enabled, CONTEXT *ctxt)
+    {
+        if (record->hot){
+            return;
+        }
+        // this execution starts over, instrumented
+        record->hot = TRUE;
+        record->executions--;
+        record->enabledExecutions -= *enabled;
+        PIN_RemoveInstrumentationInRange(record->address, record->address + record->size - 1);
+        PIN_ExecuteAt(ctxt);
+    }
+};
+
+#endif // HOT_TRACES_H
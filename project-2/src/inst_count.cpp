@@ -15,8 +15,17 @@
 
 #include "pin.H"
 #include <iostream>
+#include <vector>
 #include <unordered_map>
+#include <algorithm>
 #include <string.h>
+#include "rtn_table.h"
+#include "latency_table.h"
+#include "fast_forward.h"
+#include "snapshot.h"
+#include "shadow_stack.h"
+#include "tool_register.h"
+#include "cache_aligned.h"
 using std::cerr;
 using std::endl;
 using std::string;
@@ -27,20 +36,104 @@ using std::string;
 
 // COS375 TIP: Add global variables here 
 
-// tracks the order in which routines appear
-std::vector<std::string> routines; 
+// interned routine names; analysis code only sees the ids
+RTN_TABLE rtnTable;
 
-// tracks the number of instructions for each routine
-std::unordered_map<std::string, int> instructionCount;
+// tracks the order in which routines appear (by routine id)
+std::vector<UINT32> routines; 
+
+// tracks the number of instructions for each routine id, merged from every
+// thread's shard when the thread exits (and at Fini for threads still alive)
+std::vector<UINT64> instructionCount;
+
+// whether a routine id is already in routines
+std::vector<bool> listed;
+
+// -inclusive: instructions executed under each routine, callees included,
+// and number of calls, by routine id
+std::vector<UINT64> inclusiveCount;
+std::vector<UINT64> callCount;
+
+// -cycles: estimated cycles (in LATENCY_TABLE::SCALE units) by routine id
+std::vector<UINT64> cycleCount;
+LATENCY_TABLE latencyTable;
 
-string routineName;
 bool foundMain = false;
 FILE *outFile;
 
+// -ff: skips instructions before any counting is instrumented
+FAST_FORWARD fastForward;
+
+// writes the counts so far when the snapshot signal arrives
+SNAPSHOT snapshot;
+
+// Without -bbv the count of each thread lives in a tool register (-cycles
+// keeps its per-block costs in memory). Routine entries and returns are
+// passed its value and attribute from it; thread_data_t::count is only
+// written at thread exit, before Fini and for snapshots
+TOOL_REGISTER countRegister;
+bool countInRegister = false;
+
+// guards routines, listed, liveThreads and the merged counts
+PIN_LOCK countLock;
+
+// Per-thread counter shard. The hot counter is bumped by the owning thread
+// only and is attributed to the routine it belongs to on the next routine
+// entry, so no two threads ever write the same cache line while counting:
+// the shard and its counter arrays are allocated on lines of their own.
+const UINT32 INVALID_RTN_ID = ~0u;
+typedef std::vector<UINT64, CACHE_ALIGNED_ALLOCATOR<UINT64> > counters_t;
+
+class thread_data_t : public CACHE_ALIGNED
+{
+  public:
+    thread_data_t(THREADID tid) : tid(tid), count(0), attributed(0), cycles(0), attributedCycles(0),
+        routineId(INVALID_RTN_ID), intervalStart(0), nextInterval(0), bbv(0), bbvFile(0) {}
+    THREADID tid;
+    UINT64 count;       // instructions executed by this thread since main
+    UINT64 attributed;  // part of count already charged to a routine
+    UINT64 cycles;           // estimated cycles of those instructions, -cycles only
+    UINT64 attributedCycles; // part of cycles already charged to a routine
+    UINT32 routineId;   // routine this thread last entered (-inclusive: top of stack)
+    counters_t instructionCount;          // indexed by routine id
+    std::vector<bool> seen;               // routine ids this thread entered
+    SHADOW_STACK stack;                   // shadow call stack, -inclusive only
+    std::vector<UINT32, CACHE_ALIGNED_ALLOCATOR<UINT32> > active; // frames of each routine id on the stack
+    counters_t inclusive;                 // indexed by routine id
+    counters_t calls;                     // indexed by routine id
+    counters_t cycleCount;                // indexed by routine id
+    UINT64 intervalStart; // value of count that started the current BBV interval
+    UINT64 nextInterval; // value of count that ends the current BBV interval
+    UINT64 *bbv;         // instructions executed per basic block id, -bbv only
+    FILE *bbvFile;
+};
+
+// Per-thread shards indexed by thread id. A plain table rather than a Pin
+// TLS key, so that the analysis routines stay branch free and can be
+// inlined.
+static thread_data_t *threadData[PIN_MAX_THREADS];
+
+// shards of threads that have not been merged yet
+std::vector<thread_data_t *> liveThreads;
+
 /* ===================================================================== */
 /* Commandline Switches */
 /* ===================================================================== */
 
+KNOB<BOOL> KnobBbv(KNOB_MODE_WRITEONCE, "pintool",
+    "bbv", "0", "emit basic block vectors; instructions are counted per basic block");
+KNOB<UINT64> KnobBbvInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "bbv_interval", "100", "basic block vector interval, in millions of instructions");
+KNOB<string> KnobBbvFile(KNOB_MODE_WRITEONCE, "pintool",
+    "bbv_file", "inst_count.bb", "basic block vector file (threads other than 0 append .<tid>)");
+KNOB<UINT32> KnobBbvMaxBlocks(KNOB_MODE_WRITEONCE, "pintool",
+    "bbv_max_blocks", "1048576", "maximum number of distinct basic blocks in a vector");
+KNOB<BOOL> KnobInclusive(KNOB_MODE_WRITEONCE, "pintool",
+    "inclusive", "0", "keep a shadow call stack and report name:self:inclusive:calls");
+KNOB<BOOL> KnobCycles(KNOB_MODE_WRITEONCE, "pintool",
+    "cycles", "0", "also report estimated cycles per routine (appended as :cycles)");
+KNOB<string> KnobLatencyFile(KNOB_MODE_WRITEONCE, "pintool",
+    "latency_file", "", "file of \"<ICLASS> <cycles>\" lines overriding the default costs");
 
 /* ===================================================================== */
 /* Print Help Message                                                    */
@@ -61,23 +154,131 @@ INT32 Usage()
 
 /* ===================================================================== */
 // call-back for each instruction, increments the number of instrucions
-// seen for each routine
-VOID docount()
+// seen by the executing thread
+VOID PIN_FAST_ANALYSIS_CALL docount(THREADID tid)
+{
+    threadData[tid]->count += foundMain;
+}
+
+// docount with the count in the tool register
+ADDRINT PIN_FAST_ANALYSIS_CALL docountRegister(ADDRINT count)
+{
+    return count + foundMain;
+}
+
+// -cycles: call-back for each basic block (without -bbv, which counts
+// the cost in countBlock); cost is the summed cost of its instructions,
+// precomputed when the block is instrumented
+VOID PIN_FAST_ANALYSIS_CALL countCycles(THREADID tid, UINT32 cost)
+{
+    threadData[tid]->cycles += cost * foundMain;
+}
+
+// charges the instructions counted since the last routine entry to the
+// routine that was running; count is the thread's instruction count
+VOID attributeCount(thread_data_t *tdata, UINT64 count)
 {
-    if (foundMain){
-        instructionCount[routineName]++;
+    if (tdata->routineId != INVALID_RTN_ID){
+        tdata->instructionCount[tdata->routineId] += count - tdata->attributed;
+        tdata->cycleCount[tdata->routineId] += tdata->cycles - tdata->attributedCycles;
+    }
+    tdata->attributed = count;
+    tdata->attributedCycles = tdata->cycles;
+}
+
+// adds a thread's shard to the global totals; caller holds countLock
+VOID mergeShard(thread_data_t *tdata)
+{
+    attributeCount(tdata, tdata->count);
+
+    // routines that are still on the stack are charged up to now
+    for (size_t i = 0; i < tdata->stack.Depth(); ++i){
+        const shadow_frame_t &frame = tdata->stack[i];
+        if (tdata->active[frame.routineId] != 0){
+            tdata->inclusive[frame.routineId] += tdata->count - frame.entryCount;
+            tdata->active[frame.routineId] = 0;
+        }
+    }
+    tdata->stack.Clear();
+
+    size_t size = tdata->instructionCount.size();
+    if (instructionCount.size() < size){
+        instructionCount.resize(size, 0);
+        inclusiveCount.resize(size, 0);
+        callCount.resize(size, 0);
+        cycleCount.resize(size, 0);
+    }
+    for (size_t id = 0; id < size; ++id){
+        instructionCount[id] += tdata->instructionCount[id];
+        tdata->instructionCount[id] = 0;
+        inclusiveCount[id] += tdata->inclusive[id];
+        tdata->inclusive[id] = 0;
+        callCount[id] += tdata->calls[id];
+        tdata->calls[id] = 0;
+        cycleCount[id] += tdata->cycleCount[id];
+        tdata->cycleCount[id] = 0;
     }
 }
 
 /* ===================================================================== */
-// A callback function executed at runtime before executing first
-// instruction in a function
-void executeBeforeRoutine(ADDRINT ip)
+// Shadow call stack (-inclusive). A routine's inclusive count is only
+// taken from its outermost frame, so recursive calls are not counted twice.
+// Frames are matched by stack pointer, so routines left through longjmp,
+// exceptions or tail calls are popped at the next entry or return.
+
+VOID pushFrame(thread_data_t *tdata, UINT32 routineId, ADDRINT sp, UINT64 count)
+{
+    tdata->stack.Push(sp, routineId, count);
+    tdata->active[routineId]++;
+    tdata->calls[routineId]++;
+}
+
+// pops the frames that have been left by the time a routine is entered, or
+// returns, with stack pointer sp
+VOID unwindFrames(thread_data_t *tdata, ADDRINT sp, UINT64 count)
+{
+    while (tdata->stack.Stale(sp)){
+        const shadow_frame_t &frame = tdata->stack.Top();
+        if (--tdata->active[frame.routineId] == 0){
+            tdata->inclusive[frame.routineId] += count - frame.entryCount;
+        }
+        tdata->stack.Pop();
+    }
+}
+
+// a routine returns with stack pointer sp, the thread having executed
+// count instructions
+VOID leaveRoutine(thread_data_t *tdata, ADDRINT sp, UINT64 count)
+{
+    if (tdata->stack.Empty()){
+        return;
+    }
+    attributeCount(tdata, count);
+    unwindFrames(tdata, sp, count);
+
+    // instructions after the return belong to the caller again
+    tdata->routineId = tdata->stack.Empty() ? INVALID_RTN_ID : tdata->stack.Top().routineId;
+}
+
+// call-back for each return instruction
+VOID executeAtReturn(THREADID tid, ADDRINT sp)
+{
+    leaveRoutine(threadData[tid], sp, threadData[tid]->count);
+}
+
+// executeAtReturn with the count held in the tool register
+VOID executeAtReturnRegister(THREADID tid, ADDRINT sp, ADDRINT count)
+{
+    leaveRoutine(threadData[tid], sp, count);
+}
+
+/* ===================================================================== */
+// Entry of a routine, the thread having executed count instructions
+void enterRoutine(UINT32 routineId, THREADID tid, ADDRINT sp, UINT64 count)
 {
     // Check if main function is called
     // If so then set foundMain to true
-    routineName = (RTN_FindNameByAddress(ip));
-    if (routineName.compare("main") == 0){
+    if (routineId == RTN_ID_MAIN){
         foundMain=true;
     }    
     
@@ -87,47 +288,434 @@ void executeBeforeRoutine(ADDRINT ip)
     }
 
     //COS375: Add your code here
+    thread_data_t *tdata = threadData[tid];
+    attributeCount(tdata, count);
 
-    // if routine has not been seen, add to order list
-    if (instructionCount.find(routineName) == instructionCount.end()){
-        routines.push_back(routineName);
+    // if routine has not been seen by this thread, make sure it is in the
+    // order list; other threads may have seen it first
+    if (routineId >= tdata->seen.size() || !tdata->seen[routineId]){
+        if (routineId >= tdata->seen.size()){
+            tdata->seen.resize(routineId + 1, false);
+            tdata->instructionCount.resize(routineId + 1, 0);
+            tdata->active.resize(routineId + 1, 0);
+            tdata->inclusive.resize(routineId + 1, 0);
+            tdata->calls.resize(routineId + 1, 0);
+            tdata->cycleCount.resize(routineId + 1, 0);
+        }
+        tdata->seen[routineId] = true;
+        PIN_GetLock(&countLock, tid + 1);
+        if (routineId >= listed.size()){
+            listed.resize(routineId + 1, false);
+        }
+        if (!listed[routineId]){
+            listed[routineId] = true;
+            routines.push_back(routineId);
+        }
+        PIN_ReleaseLock(&countLock);
+    }
+    tdata->routineId = routineId;
+    if (KnobInclusive){
+        unwindFrames(tdata, sp, count);
+        pushFrame(tdata, routineId, sp, count);
     }
 
     // Check if exit function is called
-    if(routineName.compare("exit") == 0){
+    if(routineId == RTN_ID_EXIT){
         foundMain=false;
     }
 }
 
+// A callback function executed at runtime before executing first
+// instruction in a function
+void executeBeforeRoutine(UINT32 routineId, THREADID tid, ADDRINT sp)
+{
+    enterRoutine(routineId, tid, sp, threadData[tid]->count);
+}
+
+// executeBeforeRoutine with the count held in the tool register
+void executeBeforeRoutineRegister(UINT32 routineId, THREADID tid, ADDRINT sp, ADDRINT count)
+{
+    enterRoutine(routineId, tid, sp, count);
+}
+
+/* ===================================================================== */
+/* Basic block vectors (-bbv)                                            */
+/* ===================================================================== */
+
+// Every basic block gets a dense id (starting at 1, as SimPoint expects)
+// the first time it is instrumented; the id is kept across re-instrumentation.
+// Once the ids run out, new blocks share the last slot of the vector.
+std::unordered_map<ADDRINT, UINT32> blockIds;
+// next free id, published at instrumentation time so that emitBbv never
+// reads blockIds while another thread's JIT is inserting into it
+volatile UINT32 nextBlockId = 1;
+UINT32 overflowBlocks = 0;  // distinct blocks counted in the shared last slot
+
+VOID startBbv(thread_data_t *tdata, THREADID tid)
+{
+    string filename = KnobBbvFile.Value();
+    if (tid != 0){
+        filename += "." + decstr(tid);
+    }
+    tdata->bbvFile = fopen(filename.c_str(), "w");
+    tdata->bbv = static_cast<UINT64 *>(CacheAlignedAlloc(KnobBbvMaxBlocks.Value() * sizeof(UINT64)));
+    tdata->nextInterval = KnobBbvInterval.Value() * 1000000;
+}
+
+// Writes the vector of the interval that just ended in the sparse
+// "T:id:count :id:count ..." format and starts a new interval. As in
+// SimPoint, a block's count is the number of instructions it executed.
+// Every interval, even one without instructions, is preceded by a
+// "# start <count>" line with the thread's instruction count at its start,
+// so a slice can be located without assuming intervals of exactly
+// -bbv_interval instructions. An interval without instructions still gets
+// its (empty) "T" line, so the line number is the interval number.
+VOID emitBbv(thread_data_t *tdata)
+{
+    fprintf(tdata->bbvFile, "# start %lu\nT", tdata->intervalStart);
+    tdata->intervalStart = tdata->count;
+    // once the ids have run out nextBlockId is the shared last slot
+    UINT32 numBlocks = std::min(nextBlockId + 1, KnobBbvMaxBlocks.Value());
+    for (UINT32 id = 1; id < numBlocks; ++id){
+        if (tdata->bbv[id] != 0){
+            fprintf(tdata->bbvFile, ":%u:%lu ", id, tdata->bbv[id]);
+            tdata->bbv[id] = 0;
+        }
+    }
+    fprintf(tdata->bbvFile, "\n");
+}
+
+// flushes the last (partial) interval and releases the vector
+VOID finishBbv(thread_data_t *tdata)
+{
+    if (tdata->bbv == 0){
+        return;
+    }
+    if (tdata->count != tdata->intervalStart){
+        emitBbv(tdata);
+    }
+    fclose(tdata->bbvFile);
+    CacheAlignedFree(tdata->bbv);
+    tdata->bbv = 0;
+}
+
+// call-back for each basic block: charges its instructions to the block
+// and to the thread's instruction count (and its precomputed cost, which
+// is 0 without -cycles, to the thread's cycles)
+VOID PIN_FAST_ANALYSIS_CALL countBlock(THREADID tid, UINT32 blockId, UINT32 numIns, UINT32 cost)
+{
+    thread_data_t *tdata = threadData[tid];
+    UINT64 n = numIns * foundMain;
+    tdata->bbv[blockId] += n;
+    tdata->count += n;
+    tdata->cycles += cost * foundMain;
+}
+
+// checked once per trace: has the current interval ended?
+ADDRINT PIN_FAST_ANALYSIS_CALL intervalDue(THREADID tid)
+{
+    return threadData[tid]->count >= threadData[tid]->nextInterval;
+}
+
+VOID intervalEnd(THREADID tid)
+{
+    thread_data_t *tdata = threadData[tid];
+    emitBbv(tdata);
+    // boundaries stay on multiples of the interval instead of drifting by
+    // the instructions of the trace that crossed them
+    tdata->nextInterval += KnobBbvInterval.Value() * 1000000;
+}
+
+/* ===================================================================== */
+// Instrumentation of the routine's first instruction, ins
+VOID InstrumentRoutineHead(INS ins, UINT32 routineId)
+{
+    //Insert callback to function executeBeforeRoutine which will be 
+    //executed just before executing first instruction in the routine
+    //at runtime; the routine is identified by its interned id and its
+    //frame by the stack pointer. It runs first, so that the per-block
+    //counters of a block starting here charge the new routine.
+    if (countInRegister){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)executeBeforeRoutineRegister, IARG_CALL_ORDER, CALL_ORDER_FIRST,
+            IARG_UINT32, routineId, IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR,
+            IARG_REG_VALUE, countRegister.Reg(), IARG_END);
+        return;
+    }
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)executeBeforeRoutine, IARG_CALL_ORDER, CALL_ORDER_FIRST,
+        IARG_UINT32, routineId, IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+}
+
+// Instrumentation of every instruction of a routine
+VOID InstrumentInstruction(INS ins)
+{
+    //COS375: Add your code here
+    // with -bbv instructions are counted per basic block in Trace()
+    if (KnobBbv){
+        // counted per basic block
+    }
+    else if (countInRegister){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docountRegister, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, countRegister.Reg(), IARG_RETURN_REGS, countRegister.Reg(), IARG_END);
+    }
+    else{
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, IARG_FAST_ANALYSIS_CALL,
+            IARG_THREAD_ID, IARG_END);
+    }
+    // pops the shadow stack; runs last so that the return itself (and a
+    // block starting at it) is still charged to the returning routine
+    if (KnobInclusive && INS_IsRet(ins) && countInRegister){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)executeAtReturnRegister, IARG_CALL_ORDER, CALL_ORDER_LAST,
+            IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR, IARG_REG_VALUE, countRegister.Reg(), IARG_END);
+    }
+    else if (KnobInclusive && INS_IsRet(ins)){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)executeAtReturn, IARG_CALL_ORDER, CALL_ORDER_LAST,
+            IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+    }
+}
+
+// -bbv: interval check at the trace head and a counter per basic block
+VOID InstrumentBbv(TRACE trace)
+{
+    INS head = BBL_InsHead(TRACE_BblHead(trace));
+    INS_InsertIfCall(head, IPOINT_BEFORE, (AFUNPTR)intervalDue, IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID, IARG_END);
+    INS_InsertThenCall(head, IPOINT_BEFORE, (AFUNPTR)intervalEnd, IARG_THREAD_ID, IARG_END);
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
+        ADDRINT address = BBL_Address(bbl);
+        std::unordered_map<ADDRINT, UINT32>::iterator it = blockIds.find(address);
+        UINT32 blockId;
+        if (it != blockIds.end()){
+            blockId = it->second;
+        }
+        else{
+            blockId = nextBlockId;
+            if (blockId >= KnobBbvMaxBlocks.Value() - 1){
+                // out of vector slots; count the block in the shared last slot
+                overflowBlocks++;
+            }
+            else{
+                nextBlockId = blockId + 1;
+            }
+            blockIds[address] = blockId;
+        }
+        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)countBlock, IARG_FAST_ANALYSIS_CALL,
+            IARG_THREAD_ID, IARG_UINT32, blockId, IARG_UINT32, BBL_NumIns(bbl),
+            IARG_UINT32, KnobCycles ? latencyTable.Cost(bbl) : 0, IARG_END);
+    }
+}
+
+// -cycles without -bbv: the cost of every basic block, summed at
+// instrumentation time
+VOID InstrumentCycles(TRACE trace)
+{
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
+        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)countCycles, IARG_FAST_ANALYSIS_CALL,
+            IARG_THREAD_ID, IARG_UINT32, latencyTable.Cost(bbl), IARG_END);
+    }
+}
+
+/* ===================================================================== */
+// Function executed everytime a new trace is found (-bbv, -cycles or -ff only)
+VOID Trace(TRACE trace, VOID *v)
+{
+    if (fastForward.InstrumentTrace(trace)){
+        return;
+    }
+
+    // with -ff the per-routine instrumentation is done here rather than in
+    // Routine(), so that it appears once fast-forwarding has ended
+    RTN rtn = TRACE_Rtn(trace);
+    if (fastForward.Enabled() && RTN_Valid(rtn)){
+        for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
+            for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)){
+                if (INS_Address(ins) == RTN_Address(rtn)){
+                    InstrumentRoutineHead(ins, rtnTable.Intern(rtn));
+                }
+                InstrumentInstruction(ins);
+            }
+        }
+    }
+
+    if (KnobBbv){
+        InstrumentBbv(trace);
+    }
+    else if (KnobCycles){
+        InstrumentCycles(trace);
+    }
+}
+
+/* ===================================================================== */
+// Allocates the counter shard of a new thread
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    thread_data_t *tdata = new thread_data_t(tid);
+    if (countInRegister){
+        countRegister.Init(ctxt, 0);
+    }
+    if (KnobBbv){
+        startBbv(tdata, tid);
+    }
+    threadData[tid] = tdata;
+    PIN_GetLock(&countLock, tid + 1);
+    liveThreads.push_back(tdata);
+    PIN_ReleaseLock(&countLock);
+}
+
+// Merges the counter shard of an exiting thread into the totals
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    thread_data_t *tdata = threadData[tid];
+    if (countInRegister){
+        tdata->count = countRegister.Value(ctxt);
+    }
+    if (KnobBbv){
+        finishBbv(tdata);
+    }
+    PIN_GetLock(&countLock, tid + 1);
+    mergeShard(tdata);
+    liveThreads.erase(std::find(liveThreads.begin(), liveThreads.end(), tdata));
+    PIN_ReleaseLock(&countLock);
+    delete tdata;
+    threadData[tid] = 0;
+}
+
 /* ===================================================================== */
 // Function executed everytime a new routine is found
 VOID Routine(RTN rtn, VOID *v)
 {
+    // with -ff routines are instrumented per trace
+    if (fastForward.Enabled()){
+        return;
+    }
+
     RTN_Open(rtn);
-    //Insert callback to function executeBeforeRoutine which will be 
-    //executed just before executing first instruction in the routine
-    //at runtime
-    INS_InsertCall(RTN_InsHead(rtn), IPOINT_BEFORE, (AFUNPTR)executeBeforeRoutine, IARG_INST_PTR, IARG_END);
+    InstrumentRoutineHead(RTN_InsHead(rtn), rtnTable.Intern(rtn));
 
     //Iterate over all instructions of routne rtn
     for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)){
-        //COS375: Add your code here
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, IARG_END);
+        InstrumentInstruction(ins);
     }
     RTN_Close(rtn);
 }
 
+// -ff: counting starts where fast-forwarding ends, which is after main
+VOID FastForwardEnd()
+{
+    foundMain = true;
+}
+
+/* ===================================================================== */
+// prints out the number of instructions for each routine in the order in which routines
+// were encountered
+// (-inclusive: name:self:inclusive:calls, -cycles appends :cycles)
+VOID writeCounts(FILE *out, std::vector<UINT64> &instructions, std::vector<UINT64> &inclusive,
+    std::vector<UINT64> &calls, std::vector<UINT64> &cycles)
+{
+    instructions.resize(rtnTable.Size(), 0);
+    inclusive.resize(rtnTable.Size(), 0);
+    calls.resize(rtnTable.Size(), 0);
+    cycles.resize(rtnTable.Size(), 0);
+    for (size_t i = 0; i < routines.size(); ++i){
+        UINT32 id = routines[i];
+        fprintf(out, "%s:%lu", rtnTable.Name(id).c_str(), instructions[id]);
+        if (KnobInclusive){
+            fprintf(out, ":%lu:%lu", inclusive[id], calls[id]);
+        }
+        if (KnobCycles){
+            fprintf(out, ":%.2f", (double)cycles[id] / LATENCY_TABLE::SCALE);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+// Snapshot callback: the merged totals plus what the live threads have
+// counted so far, leaving their shards untouched (but for counts held in
+// the tool register, which are read back). Application threads are
+// stopped, so the shards do not change underneath.
+VOID writeSnapshot(FILE *out)
+{
+    PIN_GetLock(&countLock, 1);
+    std::vector<UINT64> instructions(instructionCount);
+    std::vector<UINT64> inclusive(inclusiveCount);
+    std::vector<UINT64> calls(callCount);
+    std::vector<UINT64> cycles(cycleCount);
+    instructions.resize(rtnTable.Size(), 0);
+    inclusive.resize(rtnTable.Size(), 0);
+    calls.resize(rtnTable.Size(), 0);
+    cycles.resize(rtnTable.Size(), 0);
+
+    for (size_t i = 0; i < liveThreads.size(); ++i){
+        thread_data_t *tdata = liveThreads[i];
+        if (countInRegister){
+            tdata->count = countRegister.StoppedValue(tdata->tid, tdata->count);
+        }
+        for (size_t id = 0; id < tdata->instructionCount.size(); ++id){
+            instructions[id] += tdata->instructionCount[id];
+            inclusive[id] += tdata->inclusive[id];
+            calls[id] += tdata->calls[id];
+            cycles[id] += tdata->cycleCount[id];
+        }
+        if (tdata->routineId != INVALID_RTN_ID){
+            instructions[tdata->routineId] += tdata->count - tdata->attributed;
+            cycles[tdata->routineId] += tdata->cycles - tdata->attributedCycles;
+        }
+        // open frames, outermost frame of each routine only
+        std::vector<bool> charged(tdata->active.size(), false);
+        for (size_t f = 0; f < tdata->stack.Depth(); ++f){
+            UINT32 id = tdata->stack[f].routineId;
+            if (!charged[id]){
+                inclusive[id] += tdata->count - tdata->stack[f].entryCount;
+                charged[id] = true;
+            }
+        }
+    }
+    writeCounts(out, instructions, inclusive, calls, cycles);
+    PIN_ReleaseLock(&countLock);
+}
+
+/* ===================================================================== */
+// Called before Pin ends the threads still running, when the count is held
+// in the tool register: spills their counts to their shards. Counting has
+// stopped, since exit() has been entered. The other threads are stopped to
+// read their registers; the exiting thread's count was attributed when it
+// entered exit(), so that is its exact count.
+VOID spillCounts(VOID *v)
+{
+    THREADID self = PIN_ThreadId();
+    BOOL stopped = PIN_StopApplicationThreads(self);
+    PIN_GetLock(&countLock, self + 1);
+    for (size_t i = 0; i < liveThreads.size(); ++i){
+        thread_data_t *tdata = liveThreads[i];
+        tdata->count = countRegister.StoppedValue(tdata->tid, tdata->attributed);
+    }
+    PIN_ReleaseLock(&countLock);
+    if (stopped){
+        PIN_ResumeApplicationThreads(self);
+    }
+}
+
 /* ===================================================================== */
 // Function executed after instrumentation
 VOID Fini(INT32 code, VOID *v)
 {
     //COS375: Add your code here to dump instrumentation data that is collected.
-    // prints out the number of instructions for each routine in the order in which routines
-    // were encountered
-    for (size_t i = 0; i < routines.size(); ++i){
-        string instruction = routines[i];
-        fprintf(outFile, "%s:%d\n", instruction.c_str(), instructionCount[instruction]);
+    // threads still running at exit have not merged their shards yet (with
+    // the count in a register, spillCounts has stored their counts)
+    PIN_GetLock(&countLock, 1);
+    for (size_t i = 0; i < liveThreads.size(); ++i){
+        if (KnobBbv){
+            finishBbv(liveThreads[i]);
+        }
+        mergeShard(liveThreads[i]);
     }
+    PIN_ReleaseLock(&countLock);
+    if (overflowBlocks > 0){
+        cerr << "inst_count: " << overflowBlocks << " basic blocks beyond -bbv_max_blocks share block id "
+             << KnobBbvMaxBlocks.Value() - 1 << endl;
+    }
+
+    writeCounts(outFile, instructionCount, inclusiveCount, callCount, cycleCount);
 
     fprintf(outFile,"COS375 pin tool Template");
     fclose(outFile);
@@ -146,11 +734,31 @@ int main(int argc, char *argv[])
     {
         return Usage();
     }
+    if (KnobBbv && KnobBbvMaxBlocks.Value() < 2){
+        cerr << "-bbv_max_blocks must leave room for at least one block" << endl;
+        return Usage();
+    }
     
 
     outFile = fopen("inst_count.out","w");
+    if (!KnobLatencyFile.Value().empty() && !latencyTable.Load(KnobLatencyFile.Value().c_str())){
+        cerr << "cannot read " << KnobLatencyFile.Value() << endl;
+        return -1;
+    }
+    PIN_InitLock(&countLock);
+    countInRegister = !KnobBbv && countRegister.Claim();
+    fastForward.Activate(FastForwardEnd);
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
     RTN_AddInstrumentFunction(Routine, 0);
+    if (KnobBbv || KnobCycles || fastForward.Enabled()){
+        TRACE_AddInstrumentFunction(Trace, 0);
+    }
+    if (countInRegister){
+        PIN_AddPrepareForFiniFunction(spillCounts, 0);
+    }
     PIN_AddFiniFunction(Fini, 0);
+    snapshot.Activate("inst_count.out", writeSnapshot);
 
     // Never returns
     PIN_StartProgram();
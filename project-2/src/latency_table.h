@@ -0,0 +1,133 @@
+/*! @file
+ *  Per-iclass cost model shared by inst_count and insmix.
+ *
+ *  Every XED iclass gets an estimated cost in hundredths of a cycle, so that
+ *  the cost of a basic block can be summed into an integer at
+ *  instrumentation time. The defaults are rough figures for a recent
+ *  out-of-order x86 core (simple ALU ops 1 cycle, multiplies 3, divides and
+ *  square roots 11-42, serializing instructions tens of cycles), plus a
+ *  penalty for memory reads/writes and lock prefixes. They can be
+ *  overridden from a file with lines of the form
+ *
+ *      <ICLASS> <cycles>      e.g.   DIV 26
+ *
+ *  Lines starting with '#' and empty lines are ignored. Other lines that do
+ *  not parse, or name no XED iclass, are reported on stderr and skipped, so
+ *  a typo does not silently leave the default cost in place.
+ */
+#ifndef LATENCY_TABLE_H
+#define LATENCY_TABLE_H
+
+#include "pin.H"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+class LATENCY_TABLE
+{
+  public:
+    // hundredths of a cycle; costs are summed and divided by this for output
+    static const UINT32 SCALE = 100;
+
+    LATENCY_TABLE() : _memReadCost(4 * SCALE), _memWriteCost(1 * SCALE), _lockCost(18 * SCALE)
+    {
+        for (UINT32 i = 0; i < XED_ICLASS_LAST; i++){
+            _cost[i] = 1 * SCALE;
+        }
+
+        Set(XED_ICLASS_IMUL, 3);      Set(XED_ICLASS_MUL, 3);
+        Set(XED_ICLASS_DIV, 26);      Set(XED_ICLASS_IDIV, 42);
+        Set(XED_ICLASS_POPCNT, 3);    Set(XED_ICLASS_LZCNT, 3);     Set(XED_ICLASS_TZCNT, 3);
+
+        Set(XED_ICLASS_ADDSD, 4);     Set(XED_ICLASS_ADDPD, 4);
+        Set(XED_ICLASS_MULSD, 4);     Set(XED_ICLASS_MULPD, 4);     Set(XED_ICLASS_VFMADD231PD, 4);
+        Set(XED_ICLASS_DIVSS, 11);    Set(XED_ICLASS_DIVPS, 11);    Set(XED_ICLASS_VDIVPS, 11);
+        Set(XED_ICLASS_DIVSD, 14);    Set(XED_ICLASS_DIVPD, 14);
+        Set(XED_ICLASS_VDIVSD, 14);   Set(XED_ICLASS_VDIVPD, 14);
+        Set(XED_ICLASS_SQRTSS, 12);   Set(XED_ICLASS_SQRTPS, 12);   Set(XED_ICLASS_VSQRTPS, 12);
+        Set(XED_ICLASS_SQRTSD, 18);   Set(XED_ICLASS_SQRTPD, 18);
+        Set(XED_ICLASS_VSQRTSD, 18);  Set(XED_ICLASS_VSQRTPD, 18);
+
+        Set(XED_ICLASS_FDIV, 15);     Set(XED_ICLASS_FSQRT, 21);
+        Set(XED_ICLASS_FSIN, 70);     Set(XED_ICLASS_FCOS, 70);
+        Set(XED_ICLASS_FPTAN, 100);   Set(XED_ICLASS_FYL2X, 60);
+
+        Set(XED_ICLASS_CALL_NEAR, 2); Set(XED_ICLASS_RET_NEAR, 2);
+        Set(XED_ICLASS_ENTER, 12);    Set(XED_ICLASS_LEAVE, 2);
+
+        Set(XED_ICLASS_XCHG, 1);      Set(XED_ICLASS_CMPXCHG, 6);   Set(XED_ICLASS_XADD, 3);
+        Set(XED_ICLASS_MFENCE, 33);   Set(XED_ICLASS_LFENCE, 4);    Set(XED_ICLASS_SFENCE, 6);
+        Set(XED_ICLASS_CLFLUSH, 50);  Set(XED_ICLASS_PAUSE, 140);
+        Set(XED_ICLASS_CPUID, 100);   Set(XED_ICLASS_RDTSC, 25);    Set(XED_ICLASS_RDRAND, 100);
+        Set(XED_ICLASS_SYSCALL, 100); Set(XED_ICLASS_INT, 100);
+        Set(XED_ICLASS_REP_MOVSB, 30); Set(XED_ICLASS_REP_STOSB, 30);
+    }
+
+    // Reads "<ICLASS> <cycles>" overrides; returns FALSE if the file can not be opened
+    BOOL Load(const char *filename)
+    {
+        FILE *in = fopen(filename, "r");
+        if (in == 0){
+            return FALSE;
+        }
+        char line[256];
+        char name[128];
+        double cycles;
+        for (UINT32 number = 1; fgets(line, sizeof(line), in); number++){
+            if (line[0] == '#' || sscanf(line, "%127s", name) != 1){
+                continue;
+            }
+            if (sscanf(line, "%127s %lf", name, &cycles) != 2){
+                fprintf(stderr, "%s:%u: expected \"<ICLASS> <cycles>\", line ignored\n", filename, number);
+                continue;
+            }
+            xed_iclass_enum_t iclass = str2xed_iclass_enum_t(name);
+            if (iclass == XED_ICLASS_INVALID){
+                fprintf(stderr, "%s:%u: unknown iclass %s, line ignored\n", filename, number, name);
+                continue;
+            }
+            _cost[iclass] = (UINT32)(cycles * SCALE + 0.5);
+        }
+        fclose(in);
+        return TRUE;
+    }
+
+    // Estimated cost of ins, in hundredths of a cycle
+    UINT32 Cost(INS ins) const
+    {
+        UINT32 cost = _cost[INS_Opcode(ins)];
+        if (INS_IsMemoryRead(ins)){
+            cost += _memReadCost;
+        }
+        if (INS_IsMemoryWrite(ins)){
+            cost += _memWriteCost;
+        }
+        if (INS_LockPrefix(ins)){
+            cost += _lockCost;
+        }
+        return cost;
+    }
+
+    // Estimated cost of all instructions of bbl, in hundredths of a cycle
+    UINT32 Cost(BBL bbl) const
+    {
+        UINT32 cost = 0;
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)){
+            cost += Cost(ins);
+        }
+        return cost;
+    }
+
+  private:
+    UINT32 _cost[XED_ICLASS_LAST];
+    UINT32 _memReadCost;
+    UINT32 _memWriteCost;
+    UINT32 _lockCost;
+
+    VOID Set(xed_iclass_enum_t iclass, UINT32 cycles)
+    {
+        _cost[iclass] = cycles * SCALE;
+    }
+};
+
+#endif // LATENCY_TABLE_H
@@ -0,0 +1,101 @@
+/*! @file
+ *  Set of the distinct cache lines touched during one routine invocation,
+ *  used by mem_trace -footprint.
+ *
+ *  The set is an open-addressed table with linear probing. Every slot is
+ *  stamped with the epoch it was filled in, and a slot of an older epoch
+ *  counts as empty, so starting the next invocation (Reset) only bumps the
+ *  epoch instead of clearing the table. The table keeps its size from one
+ *  invocation to the next and doubles when it gets half full. The lines
+ *  are also kept in insertion order, so a caller can add them to its own
+ *  set without scanning the table. A set is only used by one thread.
+ */
+#ifndef LINE_SET_H
+#define LINE_SET_H
+
+#include "pin.H"
+#include <vector>
+
+class LINE_SET
+{
+  public:
+    LINE_SET(UINT32 capacity = 256) : _slots(capacity), _epoch(1), _last(~0ULL)
+    {
+    }
+
+    // empties the set for the next invocation
+    VOID Reset()
+    {
+        _lines.clear();
+        _last = ~0ULL;
+        if (++_epoch == 0){
+            // the epoch has wrapped around, the stamps are ambiguous
+            _slots.assign(_slots.size(), slot_t());
+            _epoch = 1;
+        }
+    }
+
+    // Adds line; TRUE if it was not in the set yet
+    BOOL Insert(UINT64 line)
+    {
+        // most accesses are to the line accessed last
+        if (line == _last){
+            return FALSE;
+        }
+        _last = line;
+        if ((_lines.size() + 1) * 2 > _slots.size()){
+            Grow();
+        }
+        UINT32 mask = _slots.size() - 1;
+        for (UINT32 i = Hash(line) & mask; ; i = (i + 1) & mask){
+            if (_slots[i].epoch != _epoch){
+                _slots[i].line = line;
+                _slots[i].epoch = _epoch;
+                _lines.push_back(line);
+                return TRUE;
+            }
+            if (_slots[i].line == line){
+                return FALSE;
+            }
+        }
+    }
+
+    UINT32 Size() const { return _lines.size(); }
+
+    // the lines of the set, in the order they were added
+    const std::vector<UINT64> &Lines() const { return _lines; }
+
+  private:
+    struct slot_t
+    {
+        slot_t() : line(0), epoch(0) {}
+        UINT64 line;
+        UINT32 epoch;   // epoch the slot was filled in
+    };
+
+    std::vector<slot_t> _slots;     // size is a power of two
+    std::vector<UINT64> _lines;
+    UINT32 _epoch;
+    UINT64 _last;
+
+    static UINT32 Hash(UINT64 line)
+    {
+        return (UINT32)((line * 0x9e3779b97f4a7c15ULL) >> 32);
+    }
+
+    VOID Grow()
+    {
+        _slots.assign(_slots.size() * 2, slot_t());
+        UINT32 mask = _slots.size() - 1;
+        for (size_t n = 0; n < _lines.size(); n++){
+            UINT32 i = Hash(_lines[n]) & mask;
+            while (_slots[i].epoch == _epoch){
+                i = (i + 1) & mask;
+            }
+            _slots[i].line = _lines[n];
+            _slots[i].epoch = _epoch;
+        }
+    }
+};
+
+#endif // LINE_SET_H
@@ -0,0 +1,96 @@
+/*! @file
+ *  Log-linear histogram (in the style of HdrHistogram) used by the
+ *  project-2 tools for latency distributions.
+ *
+ *  Values below 2 * SUB_BUCKETS have a bucket each. Above that, every
+ *  power of two is split into SUB_BUCKETS linear buckets, so a value is
+ *  known to within 1 / SUB_BUCKETS (about 3%) of itself whatever its size.
+ *  The whole UINT64 range fits in a fixed array of counters, so recording
+ *  costs a bit scan and an increment and memory does not depend on the
+ *  number of values recorded. The maximum is kept exactly.
+ */
+#ifndef LOG_HISTOGRAM_H
+#define LOG_HISTOGRAM_H
+
+#include "pin.H"
+#include <string.h>
+
+class LOG_HISTOGRAM
+{
+  public:
+    static const UINT32 SUB_BITS = 5;
+    static const UINT32 SUB_BUCKETS = 1 << SUB_BITS;
+    static const UINT32 NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    LOG_HISTOGRAM() : _total(0), _max(0)
+    {
+        memset(_counts, 0, sizeof(_counts));
+    }
+
+    VOID Record(UINT64 value)
+    {
+        _counts[Index(value)]++;
+        _total++;
+        if (value > _max){
+            _max = value;
+        }
+    }
+
+    VOID Add(const LOG_HISTOGRAM &other)
+    {
+        for (UINT32 i = 0; i < NUM_BUCKETS; i++){
+            _counts[i] += other._counts[i];
+        }
+        _total += other._total;
+        if (other._max > _max){
+            _max = other._max;
+        }
+    }
+
+    UINT64 Total() const { return _total; }
+    UINT64 Max() const { return _max; }
+
+    // Smallest recorded value v (to bucket precision) such that at least
+    // fraction of the values are <= v; 0 if nothing was recorded
+    UINT64 Percentile(double fraction) const
+    {
+        if (_total == 0){
+            return 0;
+        }
+        UINT64 rank = (UINT64)(fraction * _total + 0.5);
+        if (rank == 0){
+            rank = 1;
+        }
+        UINT64 seen = 0;
+        for (UINT32 i = 0; i < NUM_BUCKETS; i++){
+            seen += _counts[i];
+            if (seen >= rank){
+                UINT64 high = Highest(i);
+                return high < _max ? high : _max;
+            }
+        }
+        return _max;
+    }
+
+  private:
+    UINT64 _counts[NUM_BUCKETS];
+    UINT64 _total;
+    UINT64 _max;
+
+    static UINT32 Index(UINT64 value)
+    {
+        UINT32 msb = value ? 63 - __builtin_clzll(value) : 0;
+        UINT32 shift = msb > SUB_BITS ? msb - SUB_BITS : 0;
+        return shift * SUB_BUCKETS + (UINT32)(value >> shift);
+    }
+
+    // largest value that falls into bucket index
+    static UINT64 Highest(UINT32 index)
+    {
+        UINT32 shift = index < 2 * SUB_BUCKETS ? 0 : index / SUB_BUCKETS - 1;
+        UINT64 top = index - shift * SUB_BUCKETS;
+        return ((top + 1) << shift) - 1;
+    }
+};
+
+#endif // LOG_HISTOGRAM_H
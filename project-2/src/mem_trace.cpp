@@ -16,6 +16,16 @@
 #include "pin.H"
 #include <iostream>
 #include <string.h>
+#include <vector>
+#include <algorithm>
+#include "rtn_table.h"
+#include "shadow_stack.h"
+#include "line_set.h"
+#include "log_histogram.h"
+#include "fast_forward.h"
+#include "snapshot.h"
+#include "hot_traces.h"
+#include "overhead_budget.h"
 using std::cerr;
 using std::endl;
 using std::string;
@@ -25,14 +35,63 @@ using std::string;
 /* ===================================================================== */
 
 // COS375 TIP: Add global variables here 
-string routineName;
+
+// interned routine names; analysis code only sees the ids
+RTN_TABLE rtnTable;
 bool foundMain = false;
 FILE *outFile;
 
+// -ff: skips instructions before any tracing is instrumented
+FAST_FORWARD fastForward;
+
+// -hot: traces are only traced once they have run often enough
+HOT_TRACES hotTraces;
+
+// -budget: traces switch to a version without tracing to bound the slowdown
+OVERHEAD_BUDGET budget;
+
+// records how far the output has got when the snapshot signal arrives
+SNAPSHOT snapshot;
+
+// -footprint: lastLine of a thread whose current set has just changed
+const ADDRINT NO_LINE = ~(ADDRINT)0;
+
+// -footprint: distinct cache lines touched per invocation of a routine,
+// its callees included
+struct footprint_t
+{
+    footprint_t() : lines(0) {}
+    LOG_HISTOGRAM histogram;  // lines per invocation
+    UINT64 lines;             // lines over all invocations
+};
+
+class thread_data_t
+{
+  public:
+    thread_data_t() : lastLine(NO_LINE) {}
+    ADDRINT lastLine;                    // line touched last in the current set
+    SHADOW_STACK frames;                 // routines entered and not left
+    std::vector<LINE_SET *> lineSets;    // by depth, reused by the invocations at that depth
+    std::vector<footprint_t *> footprints;  // by routine id, allocated on first use
+};
+
+// indexed by thread id, so the analysis routines stay branch free
+static thread_data_t *threadData[PIN_MAX_THREADS];
+
+// every thread that was started; kept until Fini
+std::vector<thread_data_t *> threads;
+PIN_LOCK threadLock;
+UINT32 lineShift;   // log2 of -footprint_line
+
 /* ===================================================================== */
 /* Commandline Switches */
 /* ===================================================================== */
 
+KNOB<BOOL> KnobFootprint(KNOB_MODE_WRITEONCE, "pintool",
+    "footprint", "0", "write the distinct cache lines touched per invocation of every routine instead of the trace");
+KNOB<UINT32> KnobFootprintLine(KNOB_MODE_WRITEONCE, "pintool",
+    "footprint_line", "64", "cache line size of -footprint, in bytes (a power of two)");
+
 
 /* ===================================================================== */
 /* Print Help Message                                                    */
@@ -71,15 +130,127 @@ VOID Store(ADDRINT ip, ADDRINT mem_value)
     }
 }
 
+/* ===================================================================== */
+// Working sets (-footprint)
+
+// If call-back for every memory access, instead of Load and Store. Most
+// accesses are to the line accessed last, which is already in the set,
+// so only the others call touchLine.
+ADDRINT PIN_FAST_ANALYSIS_CALL lineChanged(THREADID tid, ADDRINT address)
+{
+    return (address >> lineShift) ^ threadData[tid]->lastLine;
+}
+
+// Then call-back of lineChanged: adds the line to the current set
+VOID touchLine(THREADID tid, ADDRINT address)
+{
+    thread_data_t *tdata = threadData[tid];
+    tdata->lastLine = address >> lineShift;
+    if (foundMain && !tdata->frames.Empty()){
+        tdata->lineSets[tdata->frames.Depth() - 1]->Insert(tdata->lastLine);
+    }
+}
+
+// Pops the frames left by the time a routine is entered, or returns, with
+// stack pointer sp (all of them for ~0). The size of a frame's set goes to
+// the histogram of its routine, and its lines to the set of the caller.
+VOID unwindFrames(thread_data_t *tdata, ADDRINT sp)
+{
+    while (tdata->frames.Stale(sp)){
+        size_t depth = tdata->frames.Depth();
+        const LINE_SET *lines = tdata->lineSets[depth - 1];
+        UINT32 id = tdata->frames.Top().routineId;
+        if (id >= tdata->footprints.size()){
+            tdata->footprints.resize(id + 1, 0);
+        }
+        if (tdata->footprints[id] == 0){
+            tdata->footprints[id] = new footprint_t;
+        }
+        tdata->footprints[id]->histogram.Record(lines->Size());
+        tdata->footprints[id]->lines += lines->Size();
+        if (depth > 1){
+            LINE_SET *caller = tdata->lineSets[depth - 2];
+            for (size_t i = 0; i < lines->Lines().size(); i++){
+                caller->Insert(lines->Lines()[i]);
+            }
+        }
+        tdata->frames.Pop();
+        tdata->lastLine = NO_LINE;
+    }
+}
+
+// call-back after executeBeforeRoutine: starts the set of the invocation
+VOID enterFootprint(THREADID tid, UINT32 routineId, ADDRINT sp)
+{
+    if (!foundMain){
+        return;
+    }
+    thread_data_t *tdata = threadData[tid];
+    unwindFrames(tdata, sp);
+    tdata->frames.Push(sp, routineId, 0);
+    size_t depth = tdata->frames.Depth();
+    if (depth > tdata->lineSets.size()){
+        tdata->lineSets.push_back(new LINE_SET);
+    }
+    tdata->lineSets[depth - 1]->Reset();
+    tdata->lastLine = NO_LINE;
+}
+
+// call-back for each return instruction
+VOID leaveFootprint(THREADID tid, ADDRINT sp)
+{
+    if (foundMain){
+        unwindFrames(threadData[tid], sp);
+    }
+}
+
+// Writes "name:calls:average:p50:p90:p99:max" distinct lines per
+// invocation for every routine called, largest average first
+VOID writeFootprints(FILE *out)
+{
+    std::vector<footprint_t *> merged(rtnTable.Size(), 0);
+    PIN_GetLock(&threadLock, 1);
+    for (size_t i = 0; i < threads.size(); i++){
+        std::vector<footprint_t *> &footprints = threads[i]->footprints;
+        for (size_t id = 0; id < footprints.size(); id++){
+            if (footprints[id] == 0){
+                continue;
+            }
+            if (merged[id] == 0){
+                merged[id] = new footprint_t;
+            }
+            merged[id]->histogram.Add(footprints[id]->histogram);
+            merged[id]->lines += footprints[id]->lines;
+        }
+    }
+    PIN_ReleaseLock(&threadLock);
+
+    std::vector<std::pair<double, UINT32> > order;
+    for (UINT32 id = 0; id < merged.size(); id++){
+        if (merged[id] != 0){
+            order.push_back(std::make_pair((double)merged[id]->lines / merged[id]->histogram.Total(), id));
+        }
+    }
+    std::sort(order.rbegin(), order.rend());
+    for (size_t i = 0; i < order.size(); i++){
+        const LOG_HISTOGRAM &histogram = merged[order[i].second]->histogram;
+        fprintf(out, "%s:%lu:%.1f:%lu:%lu:%lu:%lu\n", rtnTable.Name(order[i].second).c_str(),
+            histogram.Total(), order[i].first, histogram.Percentile(0.5), histogram.Percentile(0.9),
+            histogram.Percentile(0.99), histogram.Max());
+    }
+    for (size_t id = 0; id < merged.size(); id++){
+        delete merged[id];
+    }
+}
+
 /* ===================================================================== */
 // A callback function executed at runtime before executing first
 // instruction in a function
-void executeBeforeRoutine(ADDRINT ip)
+void executeBeforeRoutine(UINT32 routineId)
 {
     // Check if main function is called
     // If so then set foundMain to true
-    routineName = (RTN_FindNameByAddress(ip));
-    if (routineName.compare("main") == 0){
+    if (routineId == RTN_ID_MAIN){
         foundMain=true;
     }    
     
@@ -89,44 +260,179 @@ void executeBeforeRoutine(ADDRINT ip)
     }
         
     // Check if exit function is called
-    if(routineName.compare("exit") == 0){
+    if(routineId == RTN_ID_EXIT){
         foundMain=false;
     }
 }
 
+/* ===================================================================== */
+// Instrumentation of the routine's first instruction, ins
+VOID InstrumentRoutineHead(INS ins, UINT32 routineId)
+{
+    //Insert callback to function executeBeforeRoutine which will be 
+    //executed just before executing first instruction in the routine
+    //at runtime; the routine is identified by its interned id
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)executeBeforeRoutine,
+        IARG_UINT32, routineId, IARG_END);
+    if (KnobFootprint){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)enterFootprint, IARG_THREAD_ID,
+            IARG_UINT32, routineId, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+    }
+}
+
+// Instrumentation of every instruction of a routine
+VOID InstrumentInstruction(INS ins)
+{
+    // -footprint: the accesses go to the set of the current invocation
+    // instead of the trace, and returns close invocations
+    if (KnobFootprint){
+        if (INS_IsMemoryRead(ins) || INS_IsMemoryWrite(ins)){
+            IARG_TYPE ea = INS_IsMemoryRead(ins) ? IARG_MEMORYREAD_EA : IARG_MEMORYWRITE_EA;
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)lineChanged, IARG_FAST_ANALYSIS_CALL,
+                IARG_THREAD_ID, ea, IARG_END);
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)touchLine, IARG_THREAD_ID, ea, IARG_END);
+        }
+        if (INS_IsRet(ins)){
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)leaveFootprint, IARG_THREAD_ID,
+                IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+        }
+        return;
+    }
+    // inserts call-back to Load function for every memory read/load encountered
+    // passes current instruction address and address of memory being accessed
+    if (INS_IsMemoryRead(ins)){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Load, IARG_INST_PTR, IARG_MEMORYREAD_EA, IARG_END);
+    }
+    // inserts call-back to Store function for every memory write/store encountered
+    // passes current instruction address and address of memory being accessed
+    else if (INS_IsMemoryWrite(ins)){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Store, IARG_INST_PTR, IARG_MEMORYWRITE_EA, IARG_END);
+    }
+}
+
 /* ===================================================================== */
 // Function executed everytime a new routine is found
 VOID Routine(RTN rtn, VOID *v)
 {
+    // with -ff, -hot or -budget routines are instrumented per trace
+    if (fastForward.Enabled() || hotTraces.Enabled() || budget.Enabled()){
+        return;
+    }
+
     RTN_Open(rtn);
-    //Insert callback to function executeBeforeRoutine which will be 
-    //executed just before executing first instruction in the routine
-    //at runtime
-    INS_InsertCall(RTN_InsHead(rtn), IPOINT_BEFORE, (AFUNPTR)executeBeforeRoutine, IARG_INST_PTR, IARG_END);
+    InstrumentRoutineHead(RTN_InsHead(rtn), rtnTable.Intern(rtn));
 
     //Iterate over all instructions of routne rtn
     for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)){
+        InstrumentInstruction(ins);
+    }
+    RTN_Close(rtn);
+}
 
-        // inserts call-back to Load function for every memory read/load encountered
-        // passes current instruction address and address of memory being accessed
-        if (INS_IsMemoryRead(ins)){
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Load, IARG_INST_PTR, IARG_MEMORYREAD_EA, IARG_END);
-        }
-        // inserts call-back to Store function for every memory write/store encountered
-        // passes current instruction address and address of memory being accessed
-        else if (INS_IsMemoryWrite(ins)){
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Store, IARG_INST_PTR, IARG_MEMORYWRITE_EA, IARG_END);
+// Function executed everytime a new trace is found (-ff, -hot or -budget
+// only); the routine instrumentation is done here so that it appears once
+// fast-forwarding has ended, and only in hot traces. Cold traces keep the
+// routine entry call-back, so that main and exit are still seen, and count
+// their memory accesses for the estimate. So do the sampled versions of
+// -budget, which are not traced at all.
+VOID Trace(TRACE trace, VOID *v)
+{
+    if (fastForward.InstrumentTrace(trace)){
+        return;
+    }
+
+    RTN rtn = TRACE_Rtn(trace);
+    if (!RTN_Valid(rtn)){
+        return;
+    }
+    BOOL sampled = budget.InstrumentTrace(trace);
+    hot_trace_t *cold = sampled ? 0 : hotTraces.InstrumentTrace(trace);
+    if (cold){
+        cold->weight = 0;
+    }
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)){
+            if (INS_Address(ins) == RTN_Address(rtn)){
+                InstrumentRoutineHead(ins, rtnTable.Intern(rtn));
+            }
+            if (sampled){
+                continue;
+            }
+            if (!cold){
+                InstrumentInstruction(ins);
+            }
+            else if (INS_IsMemoryRead(ins) || INS_IsMemoryWrite(ins)){
+                cold->weight++;
+            }
         }
-           
     }
-    RTN_Close(rtn);
+}
+
+// -ff: tracing starts where fast-forwarding ends, which is after main
+VOID FastForwardEnd()
+{
+    foundMain = true;
+}
+
+/* ===================================================================== */
+// Allocates the data of a new thread
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    thread_data_t *tdata = new thread_data_t;
+    threadData[tid] = tdata;
+    PIN_GetLock(&threadLock, tid + 1);
+    threads.push_back(tdata);
+    PIN_ReleaseLock(&threadLock);
+}
+
+// -footprint: closes the invocations the thread leaves open
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    PIN_GetLock(&threadLock, tid + 1);
+    unwindFrames(threadData[tid], ~(ADDRINT)0);
+    PIN_ReleaseLock(&threadLock);
+}
+
+/* ===================================================================== */
+// Snapshot callback. The output is written as it is produced, so the
+// snapshot flushes it and records its length (where the trace so far ends)
+// (-footprint: writes the working sets of the invocations so far)
+VOID writeSnapshot(FILE *out)
+{
+    if (KnobFootprint){
+        writeFootprints(out);
+        return;
+    }
+    fflush(outFile);
+    fprintf(out, "mem_trace.out:%ld\n", ftell(outFile));
 }
 
 /* ===================================================================== */
 // Function executed after instrumentation
 // All function data printed as it is encountered, so no data printed in Fini
+// (-hot: but for "hot:<hot traces>:<traces>" and
+// "cold:<executions>:<estimated accesses not traced>"; -budget: but for
+// "budget:<percent>:<uninstrumented instructions per second>" and
+// "sampling:<instructions traced>:<instructions>"; -footprint: closes the
+// invocations still open and writes the working sets of the routines)
 VOID Fini(INT32 code, VOID *v)
 {
+    if (KnobFootprint){
+        PIN_GetLock(&threadLock, 1);
+        for (size_t i = 0; i < threads.size(); i++){
+            unwindFrames(threads[i], ~(ADDRINT)0);
+        }
+        PIN_ReleaseLock(&threadLock);
+        writeFootprints(outFile);
+    }
+    if (budget.Enabled()){
+        fprintf(outFile, "budget:%u:%lu\n", budget.Budget(), budget.NativeRate());
+        fprintf(outFile, "sampling:%lu:%lu\n", budget.FullInstructions(), budget.Instructions());
+    }
+    if (hotTraces.Enabled()){
+        fprintf(outFile, "hot:%u:%lu\n", hotTraces.NumHot(), hotTraces.Traces().size());
+        fprintf(outFile, "cold:%lu:%lu\n", hotTraces.ColdExecutions(), hotTraces.ColdWeight());
+    }
     fprintf(outFile,"COS375 pin tool Template");
     fclose(outFile);
 }
@@ -146,9 +452,26 @@ int main(int argc, char *argv[])
     }
     
 
+    UINT32 line = KnobFootprintLine;
+    if (line == 0 || (line & (line - 1)) != 0){
+        return Usage();
+    }
+    while ((1u << lineShift) < line){
+        lineShift++;
+    }
+
     outFile = fopen("mem_trace.out","w");
+    PIN_InitLock(&threadLock);
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
     RTN_AddInstrumentFunction(Routine, 0);
+    BOOL fastForwarding = fastForward.Activate(FastForwardEnd);
+    BOOL hot = hotTraces.Activate();
+    if (budget.Activate() || hot || fastForwarding){
+        TRACE_AddInstrumentFunction(Trace, 0);
+    }
     PIN_AddFiniFunction(Fini, 0);
+    snapshot.Activate("mem_trace.out", writeSnapshot);
 
     // Never returns
     PIN_StartProgram();
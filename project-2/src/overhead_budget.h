@@ -0,0 +1,206 @@
+/*! @file
+ *  Overhead budget of mem_trace.
+ *
+ *  With -budget <percent> the tool keeps the instrumented run within the
+ *  given share of the uninstrumented running time (e.g. 300: at most three
+ *  times as slow). Every trace is compiled in two versions: the full one,
+ *  with the tool's analysis, and a sampled one that only counts executed
+ *  instructions. A select call at each trace head switches between them
+ *  through a tool register (INS_InsertVersionCase).
+ *
+ *  A monitor thread first runs everything in the sampled version for
+ *  -budget_calibration ms to measure the near-native rate, in instructions
+ *  per wall-clock second. It then splits time into windows of
+ *  -budget_interval ms and runs the full version for the first part of
+ *  each window. At the end of a window the measured slowdown is compared
+ *  with the budget and the full part is scaled accordingly, down to a
+ *  single 10 ms tick per window. Instructions are counted separately in
+ *  the two versions, so the tool can record the ratio of instructions it
+ *  analyzed; results are rescaled by Instructions() / FullInstructions().
+ *  The counters are shared by all threads and not atomic, so both are
+ *  approximate.
+ *
+ *  A tool using -budget does its analysis from a TRACE instrumentation
+ *  function:
+ *
+ *      if (!budget.InstrumentTrace(trace)){ ... full analysis ... }
+ *
+ *  Only mem_trace uses it, since a sampled memory trace is still a useful
+ *  one. inst_count and call_graph report exact counts, calling contexts and
+ *  call traces, which dropping the analysis of whole windows would leave
+ *  inconsistent rather than approximate; they do not take -budget.
+ */
+#ifndef OVERHEAD_BUDGET_H
+#define OVERHEAD_BUDGET_H
+
+#include "pin.H"
+#include <time.h>
+#include "tool_register.h"
+
+KNOB<UINT32> KnobBudget(KNOB_MODE_WRITEONCE, "pintool",
+    "budget", "0", "keep the running time within <percent> of the uninstrumented one by sampling the trace (0: disabled; mem_trace only)");
+KNOB<UINT32> KnobBudgetCalibration(KNOB_MODE_WRITEONCE, "pintool",
+    "budget_calibration", "200", "-budget: ms spent measuring the uninstrumented rate");
+KNOB<UINT32> KnobBudgetInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "budget_interval", "1000", "-budget: ms between adjustments of the sampling ratio");
+
+class OVERHEAD_BUDGET
+{
+  public:
+    OVERHEAD_BUDGET() : _budget(0), _version(VERSION_SAMPLED), _exiting(FALSE),
+        _fullInstructions(0), _sampledInstructions(0), _nativeRate(0), _fraction(1.0) {}
+
+    // Call from main() after PIN_Init(). Returns FALSE if -budget was not
+    // given, or if no tool register or thread is left for it, in which
+    // case the tool instruments as usual.
+    BOOL Activate()
+    {
+        if (KnobBudget.Value() == 0 || !_versionRegister.Claim()){
+            return FALSE;
+        }
+        _budget = KnobBudget.Value();
+        if (PIN_SpawnInternalThread(Monitor, this, 0, &_monitorUid) == INVALID_THREADID){
+            _budget = 0;
+            return FALSE;
+        }
+        PIN_AddPrepareForFiniFunction(PrepareForFini, this);
+        return TRUE;
+    }
+
+    BOOL Enabled() const { return _budget > 0; }
+
+    // Adds the version switch and the instruction counters to trace.
+    // Returns TRUE for the sampled version, where the tool must leave the
+    // trace alone; FALSE for the full version, or without -budget.
+    BOOL InstrumentTrace(TRACE trace)
+    {
+        if (_budget == 0){
+            return FALSE;
+        }
+        BOOL sampled = TRACE_Version(trace) == VERSION_SAMPLED;
+        INS head = BBL_InsHead(TRACE_BblHead(trace));
+        INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)Select, IARG_FAST_ANALYSIS_CALL,
+            IARG_PTR, &_version, IARG_RETURN_REGS, _versionRegister.Reg(), IARG_END);
+        INS_InsertVersionCase(head, _versionRegister.Reg(), sampled ? VERSION_FULL : VERSION_SAMPLED,
+            sampled ? VERSION_FULL : VERSION_SAMPLED, IARG_END);
+
+        UINT64 *counter = sampled ? &_sampledInstructions : &_fullInstructions;
+        for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
+            BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)Count, IARG_FAST_ANALYSIS_CALL,
+                IARG_PTR, counter, IARG_ADDRINT, (ADDRINT)BBL_NumIns(bbl), IARG_END);
+        }
+        return sampled;
+    }
+
+    UINT32 Budget() const { return _budget; }
+
+    // instructions executed, and those executed with the full analysis
+    UINT64 Instructions() const { return _fullInstructions + _sampledInstructions; }
+    UINT64 FullInstructions() const { return _fullInstructions; }
+
+    // instructions per second measured during calibration (0 if it has not
+    // finished), and the share of each window currently run in full
+    UINT64 NativeRate() const { return _nativeRate; }
+    double Fraction() const { return _fraction; }
+
+  private:
+    enum { VERSION_FULL = 0, VERSION_SAMPLED = 1 };
+    static const UINT32 TICK = 10;  // ms
+
+    UINT32 _budget;
+    TOOL_REGISTER _versionRegister;
+    volatile ADDRINT _version;      // version the next trace runs in
+    PIN_THREAD_UID _monitorUid;
+    volatile BOOL _exiting;
+    UINT64 _fullInstructions;
+    UINT64 _sampledInstructions;
+    UINT64 _nativeRate;
+    double _fraction;
+
+    static ADDRINT PIN_FAST_ANALYSIS_CALL Select(const volatile ADDRINT *version)
+    {
+        return *version;
+    }
+
+    static VOID PIN_FAST_ANALYSIS_CALL Count(UINT64 *counter, ADDRINT instructions)
+    {
+        *counter += instructions;
+    }
+
+    static UINT64 NowNs()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (UINT64)now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+
+    // sleeps for ticks ticks in the given version; FALSE if the process is exiting
+    BOOL Run(ADDRINT version, UINT32 ticks)
+    {
+        _version = version;
+        for (UINT32 i = 0; i < ticks; i++){
+            if (_exiting){
+                return FALSE;
+            }
+            PIN_Sleep(TICK);
+        }
+        return !_exiting;
+    }
+
+    // instructions per second over the sampled version, 0 if none ran
+    // (e.g. while a fast-forwarding tool is not instrumenting yet)
+    UINT64 Calibrate()
+    {
+        UINT32 ticks = KnobBudgetCalibration.Value() / TICK;
+        UINT64 start = NowNs();
+        UINT64 instructions = Instructions();
+        if (!Run(VERSION_SAMPLED, ticks ? ticks : 1)){
+            return 0;
+        }
+        UINT64 elapsed = NowNs() - start;
+        return elapsed ? (UINT64)((Instructions() - instructions) * 1e9 / elapsed) : 0;
+    }
+
+    // internal thread: calibrates, then adjusts the full share every window
+    static VOID Monitor(VOID *v)
+    {
+        OVERHEAD_BUDGET *budget = static_cast<OVERHEAD_BUDGET *>(v);
+        UINT64 nativeRate = 0;
+        while (nativeRate == 0 && !budget->_exiting){
+            nativeRate = budget->Calibrate();
+        }
+        budget->_nativeRate = nativeRate;
+
+        UINT32 window = KnobBudgetInterval.Value() / TICK;
+        window = window ? window : 1;
+        while (!budget->_exiting){
+            UINT32 full = (UINT32)(budget->_fraction * window + 0.5);
+            full = full ? full : 1;
+            UINT64 start = NowNs();
+            UINT64 instructions = budget->Instructions();
+            if (!budget->Run(VERSION_FULL, full) || !budget->Run(VERSION_SAMPLED, window - full)){
+                break;
+            }
+            UINT64 elapsed = NowNs() - start;
+            UINT64 executed = budget->Instructions() - instructions;
+            if (elapsed == 0 || executed == 0){
+                continue;
+            }
+            // percent of the uninstrumented running time the window took
+            double slowdown = 100.0 * nativeRate * elapsed / (executed * 1e9);
+            double fraction = budget->_fraction * budget->_budget / slowdown;
+            budget->_fraction = fraction > 1.0 ? 1.0 : fraction < 1.0 / window ? 1.0 / window : fraction;
+        }
+        PIN_ExitThread(0);
+    }
+
+    // the monitor must be gone before Fini() runs
+    static VOID PrepareForFini(VOID *v)
+    {
+        OVERHEAD_BUDGET *budget = static_cast<OVERHEAD_BUDGET *>(v);
+        budget->_exiting = TRUE;
+        PIN_WaitForThreadTermination(budget->_monitorUid, PIN_INFINITE_TIMEOUT, 0);
+    }
+};
+
+#endif // OVERHEAD_BUDGET_H
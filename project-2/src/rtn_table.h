@@ -0,0 +1,84 @@
+/*! @file
+ *  Routine symbol table shared by the project-2 tools.
+ *
+ *  Routine names are interned once, when the routine is instrumented, and
+ *  analysis routines are handed the dense id as an IARG_UINT32 immediate.
+ *  Analysis code therefore only compares and indexes integers; names are
+ *  looked up again only when output is written.
+ *
+ *  Output may be written by an internal thread (call_graph's writer) while
+ *  the application threads are still being instrumented, so lookups and
+ *  interning take the table's lock. The names are kept in a deque, which
+ *  never moves them, so a reference returned by Name() stays valid while
+ *  other routines are interned.
+ */
+#ifndef RTN_TABLE_H
+#define RTN_TABLE_H
+
+#include "pin.H"
+#include <string>
+#include <deque>
+#include <unordered_map>
+
+// ids that are reserved for the routines every tool checks for
+const UINT32 RTN_ID_MAIN = 0;
+const UINT32 RTN_ID_EXIT = 1;
+
+class RTN_TABLE
+{
+  public:
+    RTN_TABLE()
+    {
+        PIN_InitLock(&_lock);
+        Intern("main");
+        Intern("exit");
+    }
+
+    // Returns the id of name, assigning the next free id on first use.
+    // Called at instrumentation time.
+    UINT32 Intern(const std::string &name)
+    {
+        PIN_GetLock(&_lock, 1);
+        std::unordered_map<std::string, UINT32>::const_iterator it = _ids.find(name);
+        UINT32 id;
+        if (it != _ids.end()){
+            id = it->second;
+        }
+        else{
+            id = _names.size();
+            _names.push_back(name);
+            _ids[name] = id;
+        }
+        PIN_ReleaseLock(&_lock);
+        return id;
+    }
+
+    // Interns the name of rtn
+    UINT32 Intern(RTN rtn)
+    {
+        return Intern(RTN_Name(rtn));
+    }
+
+    const std::string &Name(UINT32 id) const
+    {
+        PIN_GetLock(&_lock, 1);
+        const std::string &name = _names[id];
+        PIN_ReleaseLock(&_lock);
+        return name;
+    }
+
+    UINT32 Size() const
+    {
+        PIN_GetLock(&_lock, 1);
+        UINT32 size = _names.size();
+        PIN_ReleaseLock(&_lock);
+        return size;
+    }
+
+  private:
+    std::deque<std::string> _names;
+    std::unordered_map<std::string, UINT32> _ids;
+    mutable PIN_LOCK _lock;
+};
+
+#endif // RTN_TABLE_H
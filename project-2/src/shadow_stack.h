@@ -0,0 +1,89 @@
+/*! @file
+ *  Per-thread shadow call stack shared by the project-2 tools.
+ *
+ *  Counting calls and returns goes out of sync as soon as a routine is
+ *  left without a matching return (longjmp, C++ exceptions, tail calls).
+ *  Instead every frame records the stack pointer at routine entry, where
+ *  it points at the return address. The stack grows down, so when a
+ *  routine is entered or returns with stack pointer sp, every frame with
+ *  a stack pointer <= sp has been left: it is the returning frame itself,
+ *  a frame replaced by a tail call, or one that was unwound past. The
+ *  tools pop those frames before pushing or after returning:
+ *
+ *      while (stack.Stale(sp)){ ...; stack.Pop(); }
+ *
+ *  so the stack resynchronizes at the next entry or return, without any
+ *  per-instruction checks. A stack is only used by its own thread.
+ */
+#ifndef SHADOW_STACK_H
+#define SHADOW_STACK_H
+
+#include "pin.H"
+#include <vector>
+
+struct shadow_frame_t
+{
+    ADDRINT sp;         // stack pointer at routine entry
+    UINT32 routineId;
+    UINT64 entryCount;  // tool defined, e.g. instruction count at entry
+    UINT64 entryTime;   // tool defined, e.g. time stamp counter at entry
+    UINT32 mark;        // tool defined, e.g. flags set at entry; 0 when pushed
+};
+
+class SHADOW_STACK
+{
+  public:
+    // TRUE if the top frame has been left by the time a routine is
+    // entered, or returns, with stack pointer sp
+    BOOL Stale(ADDRINT sp) const
+    {
+        return !_frames.empty() && _frames.back().sp <= sp;
+    }
+
+    VOID Push(ADDRINT sp, UINT32 routineId, UINT64 entryCount, UINT64 entryTime = 0)
+    {
+        shadow_frame_t frame = { sp, routineId, entryCount, entryTime, 0 };
+        _frames.push_back(frame);
+    }
+
+    VOID Pop()
+    {
+        _frames.pop_back();
+    }
+
+    const shadow_frame_t &Top() const
+    {
+        return _frames.back();
+    }
+
+    shadow_frame_t &Top()
+    {
+        return _frames.back();
+    }
+
+    // frame i, 0 being the outermost one
+    const shadow_frame_t &operator[](size_t i) const
+    {
+        return _frames[i];
+    }
+
+    size_t Depth() const
+    {
+        return _frames.size();
+    }
+
+    BOOL Empty() const
+    {
+        return _frames.empty();
+    }
+
+    VOID Clear()
+    {
+        _frames.clear();
+    }
+
+  private:
+    std::vector<shadow_frame_t> _frames;
+};
+
+#endif // SHADOW_STACK_H
@@ -0,0 +1,445 @@
+/*! @file
+ *  Offline SimPoint-style clustering of the basic block vectors written by
+ *  inst_count -bbv.
+ *
+ *  Every interval's vector is normalized, reduced to a few dimensions by a
+ *  random projection and clustered with k-means for k = 1..maxk, one k per
+ *  thread of a THREAD_POOL. The clustering whose BIC score first reaches 90%
+ *  of the observed BIC range is chosen (as SimPoint does), and for every
+ *  cluster the interval closest to its centroid becomes the simulation point.
+ *
+ *  Output, in the SimPoint formats:
+ *      <prefix>.simpoints    "<interval> <cluster>"
+ *      <prefix>.weights      "<weight> <cluster>"
+ *  and a summary of the instruction ranges of the points on stdout, so the
+ *  slices can be replayed (e.g. with mem_trace's fast-forward).
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include "thread_pool.h"
+
+using std::vector;
+using std::string;
+
+/* ===================================================================== */
+/* Options */
+/* ===================================================================== */
+
+static unsigned long maxK = 10;
+static unsigned long dims = 15;
+static unsigned long iterations = 100;
+static unsigned long initializations = 5;
+static unsigned long numThreads = 4;
+static unsigned long long seed = 493575226;
+static double intervalMillions = 100;
+static double bicThreshold = 0.9;
+static string prefix = "simpoint";
+
+int Usage()
+{
+    cerr <<
+        "Usage: simpoint [options] <bbv file>\n"
+        "Selects simulation points from a basic block vector profile.\n"
+        "\n"
+        "  -k <n>         largest number of clusters tried (10)\n"
+        "  -dim <n>       dimensions after random projection (15)\n"
+        "  -iters <n>     maximum k-means iterations (100)\n"
+        "  -init <n>      random initializations per k (5)\n"
+        "  -threads <n>   k-means worker threads (4)\n"
+        "  -seed <n>      random seed (493575226)\n"
+        "  -interval <n>  interval length in millions of instructions, used to\n"
+        "                 report slice ranges of files without start lines (100)\n"
+        "  -bic <f>       fraction of the BIC range to reach (0.9)\n"
+        "  -o <prefix>    output file prefix (simpoint)\n";
+    return -1;
+}
+
+/* ===================================================================== */
+/* Profile */
+/* ===================================================================== */
+
+// One interval of the profile: sparse (block id, count) pairs
+struct INTERVAL
+{
+    vector<std::pair<unsigned long, double> > blocks;
+    double instructions;
+    unsigned long number;   // position in the file, counting empty intervals
+    double start;           // instruction count at its start, -1 if unknown
+};
+
+// Reads every "T:id:count :id:count ..." line of the file. inst_count
+// precedes each interval with "# start <count>"; an interval that executed
+// nothing (an empty "T" line, or no line at all in older files) is only
+// counted. Files without start lines give every vector its own interval
+// of unknown start.
+static bool ReadBbv(const char *filename, vector<INTERVAL> &intervals)
+{
+    std::ifstream in(filename);
+    if (!in){
+        return false;
+    }
+    string line;
+    unsigned long number = 0;
+    double start = -1;
+    bool started = false;   // a start line is waiting for its vector
+    while (std::getline(in, line)){
+        double value;
+        if (sscanf(line.c_str(), "# start %lf", &value) == 1){
+            if (started){
+                number++;
+            }
+            start = value;
+            started = true;
+            continue;
+        }
+        if (line.empty() || line[0] != 'T'){
+            continue;
+        }
+        INTERVAL interval;
+        interval.instructions = 0;
+        interval.number = number++;
+        interval.start = started ? start : -1;
+        started = false;
+        const char *p = line.c_str() + 1;
+        while ((p = strchr(p, ':')) != 0){
+            char *end;
+            unsigned long id = strtoul(p + 1, &end, 10);
+            if (*end != ':'){
+                break;
+            }
+            double count = strtod(end + 1, &end);
+            interval.blocks.push_back(std::make_pair(id, count));
+            interval.instructions += count;
+            p = end;
+        }
+        if (interval.instructions > 0){
+            intervals.push_back(interval);
+        }
+    }
+    return true;
+}
+
+/* ===================================================================== */
+/* Random projection */
+/* ===================================================================== */
+
+static unsigned long long SplitMix64(unsigned long long x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Entry (id, d) of the projection matrix, uniform in [-1, 1). It is derived
+// from a hash so the matrix never has to be stored.
+static double ProjectionEntry(unsigned long id, unsigned long d)
+{
+    unsigned long long h = SplitMix64(seed ^ SplitMix64(id * dims + d));
+    return (h >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+}
+
+// Normalizes every interval to a frequency vector and projects it to dims
+// dimensions; points is row major, one row per interval
+static void Project(const vector<INTERVAL> &intervals, vector<double> &points)
+{
+    points.assign(intervals.size() * dims, 0.0);
+    for (size_t i = 0; i < intervals.size(); ++i){
+        double *row = &points[i * dims];
+        const INTERVAL &interval = intervals[i];
+        for (size_t b = 0; b < interval.blocks.size(); ++b){
+            double freq = interval.blocks[b].second / interval.instructions;
+            for (unsigned long d = 0; d < dims; ++d){
+                row[d] += freq * ProjectionEntry(interval.blocks[b].first, d);
+            }
+        }
+    }
+}
+
+/* ===================================================================== */
+/* k-means */
+/* ===================================================================== */
+
+static double Distance2(const double *a, const double *b)
+{
+    double sum = 0;
+    for (unsigned long d = 0; d < dims; ++d){
+        double diff = a[d] - b[d];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+// Clusters the points for a single k; runs on a THREAD_POOL thread
+class KMEANS_JOB : public RUNNABLE_OBJ
+{
+  public:
+    KMEANS_JOB(const vector<double> *points, unsigned long k) :
+        _points(points), _n(points->size() / dims), _k(k), _distortion(0), _bic(0) {}
+
+    void Run()
+    {
+        unsigned long long state = SplitMix64(seed + _k);
+        vector<unsigned long> assignment;
+        vector<double> centers;
+        for (unsigned long init = 0; init < initializations; ++init){
+            double distortion = Cluster(state, assignment, centers);
+            if (init == 0 || distortion < _distortion){
+                _distortion = distortion;
+                _assignment = assignment;
+                _centers = centers;
+            }
+        }
+        _bic = Bic();
+    }
+
+    unsigned long K() const { return _k; }
+    double Score() const { return _bic; }
+    const vector<unsigned long> &Assignment() const { return _assignment; }
+    const double *Center(unsigned long c) const { return &_centers[c * dims]; }
+
+  private:
+    const vector<double> *_points;
+    unsigned long _n;
+    unsigned long _k;
+    double _distortion;
+    double _bic;
+    vector<unsigned long> _assignment;
+    vector<double> _centers;
+
+    const double *Point(unsigned long i) const { return &(*_points)[i * dims]; }
+
+    // One k-means run from k distinct random points; returns the distortion
+    double Cluster(unsigned long long &state, vector<unsigned long> &assignment,
+                   vector<double> &centers)
+    {
+        centers.assign(_k * dims, 0.0);
+        assignment.assign(_n, 0);
+
+        vector<unsigned long> chosen;
+        while (chosen.size() < _k){
+            state = SplitMix64(state);
+            unsigned long candidate = state % _n;
+            bool duplicate = false;
+            for (size_t c = 0; c < chosen.size(); ++c){
+                duplicate = duplicate || chosen[c] == candidate;
+            }
+            if (!duplicate){
+                memcpy(&centers[chosen.size() * dims], Point(candidate), dims * sizeof(double));
+                chosen.push_back(candidate);
+            }
+        }
+
+        double distortion = 0;
+        vector<unsigned long> sizes(_k);
+        for (unsigned long iter = 0; iter < iterations; ++iter){
+            bool changed = false;
+            distortion = 0;
+            for (unsigned long i = 0; i < _n; ++i){
+                unsigned long best = 0;
+                double bestDistance = Distance2(Point(i), &centers[0]);
+                for (unsigned long c = 1; c < _k; ++c){
+                    double distance = Distance2(Point(i), &centers[c * dims]);
+                    if (distance < bestDistance){
+                        bestDistance = distance;
+                        best = c;
+                    }
+                }
+                changed = changed || assignment[i] != best || iter == 0;
+                assignment[i] = best;
+                distortion += bestDistance;
+            }
+            if (!changed){
+                break;
+            }
+
+            // move every center to the mean of its points; an empty
+            // cluster keeps its old center
+            vector<double> sums(_k * dims, 0.0);
+            sizes.assign(_k, 0);
+            for (unsigned long i = 0; i < _n; ++i){
+                double *sum = &sums[assignment[i] * dims];
+                for (unsigned long d = 0; d < dims; ++d){
+                    sum[d] += Point(i)[d];
+                }
+                sizes[assignment[i]]++;
+            }
+            for (unsigned long c = 0; c < _k; ++c){
+                for (unsigned long d = 0; sizes[c] && d < dims; ++d){
+                    centers[c * dims + d] = sums[c * dims + d] / sizes[c];
+                }
+            }
+        }
+        return distortion;
+    }
+
+    // Bayesian information criterion of the clustering (Pelleg and Moore),
+    // the score SimPoint uses to pick k
+    double Bic() const
+    {
+        const double R = _n;
+        const double M = dims;
+        const double K = _k;
+        if (R <= K){
+            return 0;
+        }
+        double variance = _distortion / (R - K);
+        if (variance <= 0){
+            variance = 1e-300;
+        }
+        vector<unsigned long> sizes(_k, 0);
+        for (unsigned long i = 0; i < _n; ++i){
+            sizes[_assignment[i]]++;
+        }
+        double likelihood = 0;
+        for (unsigned long c = 0; c < _k; ++c){
+            double Rn = sizes[c];
+            if (Rn == 0){
+                continue;
+            }
+            likelihood += -Rn / 2 * log(2 * M_PI) - Rn * M / 2 * log(variance)
+                          - (Rn - K) / 2 + Rn * log(Rn) - Rn * log(R);
+        }
+        double parameters = (K - 1) + M * K + 1;
+        return likelihood - parameters / 2 * log(R);
+    }
+};
+
+/* ===================================================================== */
+/* Main */
+/* ===================================================================== */
+
+int main(int argc, char *argv[])
+{
+    const char *filename = 0;
+    for (int i = 1; i < argc; ++i){
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-k" && hasValue) maxK = strtoul(argv[++i], 0, 0);
+        else if (arg == "-dim" && hasValue) dims = strtoul(argv[++i], 0, 0);
+        else if (arg == "-iters" && hasValue) iterations = strtoul(argv[++i], 0, 0);
+        else if (arg == "-init" && hasValue) initializations = strtoul(argv[++i], 0, 0);
+        else if (arg == "-threads" && hasValue) numThreads = strtoul(argv[++i], 0, 0);
+        else if (arg == "-seed" && hasValue) seed = strtoull(argv[++i], 0, 0);
+        else if (arg == "-interval" && hasValue) intervalMillions = strtod(argv[++i], 0);
+        else if (arg == "-bic" && hasValue) bicThreshold = strtod(argv[++i], 0);
+        else if (arg == "-o" && hasValue) prefix = argv[++i];
+        else if (arg[0] != '-' && filename == 0) filename = argv[i];
+        else return Usage();
+    }
+    if (filename == 0 || maxK == 0 || dims == 0 || initializations == 0 || numThreads == 0){
+        return Usage();
+    }
+
+    vector<INTERVAL> intervals;
+    if (!ReadBbv(filename, intervals)){
+        cerr << "simpoint: cannot read " << filename << endl;
+        return 1;
+    }
+    if (intervals.empty()){
+        cerr << "simpoint: no intervals in " << filename << endl;
+        return 1;
+    }
+    if (maxK > intervals.size()){
+        maxK = intervals.size();
+    }
+
+    vector<double> points;
+    Project(intervals, points);
+
+    // one job per k, at most numThreads of them running at a time
+    vector<KMEANS_JOB *> jobs;
+    for (unsigned long k = 1; k <= maxK; ++k){
+        jobs.push_back(new KMEANS_JOB(&points, k));
+    }
+    THREAD_POOL pool;
+    unsigned long created = pool.Create(numThreads < maxK ? numThreads : maxK);
+    if (created == 0){
+        for (size_t j = 0; j < jobs.size(); ++j){
+            jobs[j]->Run();
+        }
+    }
+    for (size_t j = 0; created && j < jobs.size(); ++j){
+        unsigned long tid = j % created;
+        pool.Wait(tid);
+        pool.Start(tid, jobs[j]);
+    }
+    for (unsigned long tid = 0; tid < created; ++tid){
+        pool.Wait(tid);
+    }
+
+    // the smallest k whose score reaches the threshold of the BIC range
+    double minBic = jobs[0]->Score();
+    double maxBic = jobs[0]->Score();
+    for (size_t j = 1; j < jobs.size(); ++j){
+        minBic = std::min(minBic, jobs[j]->Score());
+        maxBic = std::max(maxBic, jobs[j]->Score());
+    }
+    const KMEANS_JOB *best = jobs.back();
+    for (size_t j = 0; j < jobs.size(); ++j){
+        if (jobs[j]->Score() >= minBic + bicThreshold * (maxBic - minBic)){
+            best = jobs[j];
+            break;
+        }
+    }
+
+    // representative interval and weight of every non-empty cluster
+    const unsigned long k = best->K();
+    const vector<unsigned long> &assignment = best->Assignment();
+    vector<long> representative(k, -1);
+    vector<double> representativeDistance(k, 0);
+    vector<double> clusterInstructions(k, 0);
+    double totalInstructions = 0;
+    for (size_t i = 0; i < intervals.size(); ++i){
+        unsigned long c = assignment[i];
+        double distance = Distance2(&points[i * dims], best->Center(c));
+        if (representative[c] < 0 || distance < representativeDistance[c]){
+            representative[c] = i;
+            representativeDistance[c] = distance;
+        }
+        clusterInstructions[c] += intervals[i].instructions;
+        totalInstructions += intervals[i].instructions;
+    }
+
+    FILE *simpoints = fopen((prefix + ".simpoints").c_str(), "w");
+    FILE *weights = fopen((prefix + ".weights").c_str(), "w");
+    if (simpoints == 0 || weights == 0){
+        cerr << "simpoint: cannot write " << prefix << ".{simpoints,weights}" << endl;
+        return 1;
+    }
+    printf("%lu intervals, k = %lu (tried 1..%lu)\n", (unsigned long)intervals.size(), k, maxK);
+    printf("# cluster  interval  weight    first-instruction  instructions\n");
+    unsigned long cluster = 0;
+    for (unsigned long c = 0; c < k; ++c){
+        if (representative[c] < 0){
+            continue;
+        }
+        const INTERVAL &interval = intervals[representative[c]];
+        double weight = clusterInstructions[c] / totalInstructions;
+        double first = interval.start >= 0 ? interval.start : interval.number * intervalMillions * 1e6;
+        fprintf(simpoints, "%lu %lu\n", interval.number, cluster);
+        fprintf(weights, "%.6f %lu\n", weight, cluster);
+        printf("%9lu %9lu  %.6f  %17.0f  %.0f\n", cluster, interval.number, weight,
+               first, interval.instructions);
+        cluster++;
+    }
+    fclose(simpoints);
+    fclose(weights);
+
+    for (size_t j = 0; j < jobs.size(); ++j){
+        delete jobs[j];
+    }
+    return 0;
+}
+
+/* ===================================================================== */
+/* eof */
+/* ===================================================================== */
@@ -0,0 +1,115 @@
+/*! @file
+ *  Live snapshots shared by the project-2 tools.
+ *
+ *  Results are normally only written by Fini(), which long running
+ *  processes may never reach. With this helper the tool intercepts a signal
+ *  (SIGUSR2 by default, -snapshot_signal) and writes a snapshot of its
+ *  current state to <prefix>.<seconds since epoch>.<n> while the
+ *  application keeps running.
+ *
+ *  The signal handler only posts a semaphore; the file is written by an
+ *  internal Pin thread that stops all application threads while the
+ *  tool's callback runs, so the callback sees the counters in a
+ *  consistent state and needs no locking against analysis routines. No
+ *  instrumentation is added, so there is no cost until a signal arrives.
+ *  The signal is still delivered to the application if it has a handler
+ *  for it; otherwise it is swallowed rather than killing the process. Use
+ *  -snapshot_signal to pick a signal the application does not use.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "pin.H"
+#include <stdio.h>
+#include <time.h>
+#include <string>
+
+KNOB<INT32> KnobSnapshotSignal(KNOB_MODE_WRITEONCE, "pintool",
+    "snapshot_signal", "12", "signal that writes a snapshot of the results so far (default SIGUSR2; "
+    "also delivered to the application if it handles it, otherwise swallowed; 0: disabled)");
+
+// writes the tool's current state to out; application threads are stopped
+typedef VOID (*SNAPSHOT_CALLBACK)(FILE *out);
+
+class SNAPSHOT
+{
+  public:
+    SNAPSHOT() : _write(0), _exiting(FALSE), _taken(0) {}
+
+    // Call from main() before PIN_StartProgram(). prefix is the start of
+    // the snapshot file names, usually the tool's output file.
+    BOOL Activate(const std::string &prefix, SNAPSHOT_CALLBACK write)
+    {
+        INT32 sig = KnobSnapshotSignal.Value();
+        if (sig == 0){
+            return FALSE;
+        }
+        _prefix = prefix;
+        _write = write;
+        PIN_SemaphoreInit(&_request);
+        if (PIN_SpawnInternalThread(Writer, this, 0, &_writerUid) == INVALID_THREADID){
+            return FALSE;
+        }
+        PIN_AddPrepareForFiniFunction(PrepareForFini, this);
+        return PIN_InterceptSignal(sig, Intercept, this);
+    }
+
+  private:
+    std::string _prefix;
+    SNAPSHOT_CALLBACK _write;
+    PIN_SEMAPHORE _request;
+    PIN_THREAD_UID _writerUid;
+    volatile BOOL _exiting;
+    UINT32 _taken;
+
+    // runs on the application thread that received the signal; passes it
+    // on to the application's own handler, if there is one
+    static BOOL Intercept(THREADID tid, INT32 sig, CONTEXT *ctxt, BOOL hasHandler,
+        const EXCEPTION_INFO *exceptInfo, VOID *v)
+    {
+        PIN_SemaphoreSet(&static_cast<SNAPSHOT *>(v)->_request);
+        return hasHandler;
+    }
+
+    // internal thread: waits for requests and writes the snapshots
+    static VOID Writer(VOID *v)
+    {
+        SNAPSHOT *snapshot = static_cast<SNAPSHOT *>(v);
+        while (!snapshot->_exiting){
+            if (!PIN_SemaphoreTimedWait(&snapshot->_request, 100)){
+                continue;
+            }
+            PIN_SemaphoreClear(&snapshot->_request);
+            if (!snapshot->_exiting){
+                snapshot->Take();
+            }
+        }
+        PIN_ExitThread(0);
+    }
+
+    VOID Take()
+    {
+        std::string filename = _prefix + "." + decstr((UINT64)time(0)) + "." + decstr(_taken++);
+        FILE *out = fopen(filename.c_str(), "w");
+        if (out == 0){
+            return;
+        }
+        // fails only if the process is exiting, Fini() then has the results
+        if (PIN_StopApplicationThreads(PIN_ThreadId())){
+            _write(out);
+            PIN_ResumeApplicationThreads(PIN_ThreadId());
+        }
+        fclose(out);
+    }
+
+    // the writer must be gone before Fini() runs
+    static VOID PrepareForFini(VOID *v)
+    {
+        SNAPSHOT *snapshot = static_cast<SNAPSHOT *>(v);
+        snapshot->_exiting = TRUE;
+        PIN_SemaphoreSet(&snapshot->_request);
+        PIN_WaitForThreadTermination(snapshot->_writerUid, PIN_INFINITE_TIMEOUT, 0);
+    }
+};
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,89 @@
+/*! @file
+ *  Bounded table of the most frequent keys of a stream (space-saving
+ *  algorithm, Metwally et al.), shared by the project-2 tools.
+ *
+ *  The table has a fixed number of counters. A key that is not tracked
+ *  while the table is full takes over the smallest counter, whose count it
+ *  inherits as its error. Every key occurring more than total / capacity
+ *  times is therefore tracked, and its count is over-estimated by at most
+ *  its error. A table is only used by one thread.
+ */
+#ifndef SPACE_SAVING_H
+#define SPACE_SAVING_H
+
+#include "pin.H"
+#include <vector>
+#include <algorithm>
+
+struct space_saving_entry_t
+{
+    UINT64 key;
+    UINT64 count;   // occurrences, including error
+    UINT64 error;   // count inherited from the evicted key
+};
+
+class SPACE_SAVING
+{
+  public:
+    SPACE_SAVING(UINT32 capacity) : _capacity(capacity ? capacity : 1), _total(0), _last(0)
+    {
+        _entries.reserve(_capacity);
+    }
+
+    // Counts one occurrence of key; TRUE if key was already tracked
+    BOOL Offer(UINT64 key)
+    {
+        _total++;
+        // runs of the same key are common, check the last one first
+        if (_last < _entries.size() && _entries[_last].key == key){
+            _entries[_last].count++;
+            return TRUE;
+        }
+        UINT32 smallest = 0;
+        for (UINT32 i = 0; i < _entries.size(); i++){
+            if (_entries[i].key == key){
+                _entries[i].count++;
+                _last = i;
+                return TRUE;
+            }
+            if (_entries[i].count < _entries[smallest].count){
+                smallest = i;
+            }
+        }
+        if (_entries.size() < _capacity){
+            space_saving_entry_t entry = { key, 1, 0 };
+            _last = _entries.size();
+            _entries.push_back(entry);
+            return FALSE;
+        }
+        space_saving_entry_t &entry = _entries[smallest];
+        entry.key = key;
+        entry.error = entry.count;
+        entry.count++;
+        _last = smallest;
+        return FALSE;
+    }
+
+    UINT64 Total() const { return _total; }
+
+    // the tracked keys, most frequent first
+    std::vector<space_saving_entry_t> Top() const
+    {
+        std::vector<space_saving_entry_t> top(_entries);
+        std::sort(top.begin(), top.end(), ByCount);
+        return top;
+    }
+
+  private:
+    UINT32 _capacity;
+    UINT64 _total;
+    UINT32 _last;   // entry hit last
+    std::vector<space_saving_entry_t> _entries;
+
+    static bool ByCount(const space_saving_entry_t &a, const space_saving_entry_t &b)
+    {
+        return a.count > b.count;
+    }
+};
+
+#endif // SPACE_SAVING_H
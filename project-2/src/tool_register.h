@@ -0,0 +1,64 @@
+/*! @file
+ *  A Pin tool register holding a per-thread value, shared by the project-2
+ *  tools and insmix.
+ *
+ *  Tool registers are virtual registers that Pin keeps per thread, in a
+ *  physical register where it can. A hot counter (or a pointer to the
+ *  thread's data) kept in one is passed to analysis routines with
+ *  IARG_REG_VALUE and updated with IARG_RETURN_REGS:
+ *
+ *      ADDRINT PIN_FAST_ANALYSIS_CALL Count(ADDRINT count) { return count + 1; }
+ *      INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Count, IARG_FAST_ANALYSIS_CALL,
+ *          IARG_REG_VALUE, reg.Reg(), IARG_RETURN_REGS, reg.Reg(), IARG_END);
+ *
+ *  so the update can be inlined with no load of a thread pointer. The tool
+ *  only reads the value back where it gets a context: at thread exit, from
+ *  the context of a thread stopped by PIN_StopApplicationThreads, or as an
+ *  IARG_REG_VALUE argument of a call it makes anyway.
+ */
+#ifndef TOOL_REGISTER_H
+#define TOOL_REGISTER_H
+
+#include "pin.H"
+
+class TOOL_REGISTER
+{
+  public:
+    TOOL_REGISTER() : _reg(REG_INVALID()) {}
+
+    // Claims a register; must be called before the application starts.
+    // FALSE if Pin has none left, the tool then keeps the value in memory.
+    BOOL Claim()
+    {
+        _reg = PIN_ClaimToolRegister();
+        return REG_valid(_reg);
+    }
+
+    BOOL Valid() const { return REG_valid(_reg); }
+    REG Reg() const { return _reg; }
+
+    // sets the value a new thread starts with (thread start callback)
+    VOID Init(CONTEXT *ctxt, ADDRINT value) const
+    {
+        PIN_SetContextReg(ctxt, _reg, value);
+    }
+
+    // value in ctxt, e.g. the context of an exiting thread
+    ADDRINT Value(const CONTEXT *ctxt) const
+    {
+        return PIN_GetContextReg(ctxt, _reg);
+    }
+
+    // value of a thread stopped by PIN_StopApplicationThreads, fallback
+    // if the thread is not stopped
+    ADDRINT StoppedValue(THREADID tid, ADDRINT fallback) const
+    {
+        const CONTEXT *ctxt = PIN_GetStoppedThreadContext(tid);
+        return ctxt ? PIN_GetContextReg(ctxt, _reg) : fallback;
+    }
+
+  private:
+    REG _reg;
+};
+
+#endif // TOOL_REGISTER_H
@@ -0,0 +1,176 @@
+/*! @file
+ *  Compression of the call_graph trace (call_graph -compress).
+ *
+ *  The trace is a preorder walk of the call tree: one routine entry per
+ *  line, indented by depth. Recursive code makes it exponential in the
+ *  input (fib), although it has very few distinct subtrees. The compressor
+ *  is fed the entries of one thread in order and keeps them as records:
+ *
+ *   - When a subtree (a routine entry and the deeper entries after it) is
+ *     complete, its shape (routine ids and nesting, not the arguments) is
+ *     hashed. If an earlier subtree had the same shape, the new one is
+ *     replaced by a single reference record to it. Memory and output are
+ *     therefore proportional to the distinct subtrees, not to the calls.
+ *   - A leaf or a copy that repeats the one just before it at the same
+ *     depth (a loop calling the same routine) only counts the repetition.
+ *   - When written, chains of calls to the same routine that each are the
+ *     first call of the previous one become run records.
+ *
+ *  Output, one record per line, indented by depth:
+ *
+ *      name(0xarg,...)           a routine entry, as in the plain trace
+ *      name x N, depth d..e      N nested calls of name at depths d to e
+ *      name @L                   a copy of the subtree whose root is the
+ *                                L-th record of this thread (1-based)
+ *      name x N                  N calls of name without callees
+ *      name @L x N               N copies of the subtree of record L
+ *
+ *  call_graph_expand turns this back into the plain trace; arguments of
+ *  runs and repeated calls are not kept and copies repeat the original's
+ *  arguments.
+ */
+#ifndef TRACE_COMPRESSOR_H
+#define TRACE_COMPRESSOR_H
+
+#include "pin.H"
+#include <stdio.h>
+#include <vector>
+#include <unordered_map>
+#include "rtn_table.h"
+
+class TRACE_COMPRESSOR
+{
+  public:
+    // Adds the entry of routineId at depth; entries are in trace order
+    VOID Add(UINT32 routineId, INT32 depth, ADDRINT argZero)
+    {
+        while (!_open.empty() && _open.back().depth >= depth){
+            Close();
+        }
+        record_t record = { routineId, depth, argZero, NO_REF, 1 };
+        open_t open = { (UINT32)_records.size(), depth, Mix(routineId + 1) };
+        _records.push_back(record);
+        _open.push_back(open);
+    }
+
+    // Writes the records so far; subtrees still open are not compressed yet
+    VOID Write(FILE *out, const RTN_TABLE &names) const
+    {
+        // records that are copied can not be folded into a run
+        std::vector<bool> target(_records.size(), false);
+        for (size_t i = 0; i < _records.size(); i++){
+            if (_records[i].ref != NO_REF){
+                target[_records[i].ref] = true;
+            }
+        }
+
+        std::vector<UINT32> line(_records.size(), 0);
+        UINT32 lines = 0;
+        for (size_t i = 0; i < _records.size(); ){
+            const record_t &record = _records[i];
+            const char *name = names.Name(record.routineId).c_str();
+            INT32 indent = record.depth > 0 ? record.depth : 0;
+            line[i] = ++lines;
+            if (record.ref != NO_REF){
+                fprintf(out, "%*s%s @%u", indent, "", name, line[record.ref]);
+                if (record.repeat > 1){
+                    fprintf(out, " x %u", record.repeat);
+                }
+                fprintf(out, "\n");
+                i++;
+                continue;
+            }
+            if (record.repeat > 1){
+                fprintf(out, "%*s%s x %u\n", indent, "", name, record.repeat);
+                i++;
+                continue;
+            }
+            size_t end = i + 1;
+            while (end < _records.size() && _records[end].ref == NO_REF && _records[end].repeat == 1 && !target[end]
+                && _records[end].routineId == record.routineId
+                && _records[end].depth == _records[end - 1].depth + 1){
+                end++;
+            }
+            if (end - i > 1){
+                fprintf(out, "%*s%s x %lu, depth %d..%d\n", indent, "", name,
+                    (unsigned long)(end - i), record.depth, _records[end - 1].depth);
+            }
+            else{
+                fprintf(out, "%*s%s(0x%lx,...)\n", indent, "", name, record.argZero);
+            }
+            i = end;
+        }
+    }
+
+  private:
+    static const UINT32 NO_REF = ~0u;
+
+    struct record_t
+    {
+        UINT32 routineId;
+        INT32 depth;
+        ADDRINT argZero;
+        UINT32 ref;     // record whose subtree this one copies, or NO_REF
+        UINT32 repeat;  // times the record occurs back to back
+    };
+
+    struct open_t
+    {
+        UINT32 record;
+        INT32 depth;
+        UINT64 hash;    // shape of the subtree so far
+    };
+
+    std::vector<record_t> _records;
+    std::vector<open_t> _open;                  // path to the last entry
+    std::unordered_map<UINT64, UINT32> _shapes; // shape hash -> first record
+
+    static UINT64 Mix(UINT64 x)
+    {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // The last open subtree is complete: replace it by a reference if an
+    // identical one was seen before, and add its shape to its parent's
+    VOID Close()
+    {
+        open_t closed = _open.back();
+        _open.pop_back();
+        UINT64 hash = Mix(closed.hash);
+        if (!_open.empty()){
+            open_t &parent = _open.back();
+            parent.hash = Mix(parent.hash ^ (hash + (UINT64)(closed.depth - parent.depth)));
+        }
+
+        // a single entry is as short as a reference
+        if (closed.record + 1 != _records.size()){
+            std::unordered_map<UINT64, UINT32>::const_iterator it = _shapes.find(hash);
+            if (it == _shapes.end()){
+                _shapes[hash] = closed.record;
+                return;
+            }
+            _records.resize(closed.record + 1);
+            _records[closed.record].ref = it->second;
+        }
+
+        // A record just before at the same depth is a previous sibling
+        // without records of its own: a leaf or a copy. Neither is ever
+        // copied, so it can count this one.
+        if (closed.record == 0){
+            return;
+        }
+        record_t &last = _records[closed.record];
+        record_t &previous = _records[closed.record - 1];
+        if (previous.depth == last.depth && previous.routineId == last.routineId && previous.ref == last.ref){
+            previous.repeat++;
+            _records.pop_back();
+        }
+    }
+};
+
+#endif // TRACE_COMPRESSOR_H
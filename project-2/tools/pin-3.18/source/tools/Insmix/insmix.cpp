@@ -21,9 +21,15 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <unistd.h>
 #include "pin.H"
 #include "control_manager.H"
+#include "latency_table.h"
+#include "tool_register.h"
+#include "hot_traces.h"
+#include "cache_aligned.h"
+#include "snapshot.h"
 
 using namespace CONTROLLER;
 
@@ -49,15 +55,122 @@ KNOB<BOOL>   KnobNoSharedLibs(KNOB_MODE_WRITEONCE,       "pintool",
     "no_shared_libs", "0", "do not instrument shared libraries");
 KNOB<UINT32> KnobNumInstructions(KNOB_MODE_WRITEONCE,    "pintool",
     "num_instructions", "0", "Maximum instructions before detach (zero means no limit)");
+KNOB<BOOL>   KnobCycles(KNOB_MODE_WRITEONCE,             "pintool",
+    "cycles", "0", "report estimated cycles per routine");
+KNOB<string> KnobLatencyFile(KNOB_MODE_WRITEONCE,        "pintool",
+    "latency_file", "", "file of \"<ICLASS> <cycles>\" lines overriding the default costs");
+
+LOCALVAR LATENCY_TABLE latency_table;
 
 LOCALFUN string longstr(int rtn_no, const char *name) {return string("rtn[") + decstr(rtn_no) + string(",") + string(name) + string("]");}
 
-// The running count of instructions is kept here
-// make it static to help the compiler optimize count_instructions
-static UINT64 inscount = 0;
+/* ===================================================================== */
+/* Per-thread counter shards */
+/* ===================================================================== */
+
+// Every thread counts into its own shard so that counters are exact and no
+// cache line is written by more than one thread: shards and their counter
+// chunks are allocated on lines of their own. Shards are merged into the
+// global statistics when the thread exits and at Fini/Detach.
+
+typedef UINT64 COUNTER;
+
+const UINT32 MAX_INDEX = 4096;
+
+// bbl counters are kept in fixed size chunks. Every shard has the chunks of
+// all bbls instrumented so far; they are allocated at instrumentation time
+// (ReserveBblCounter) and at thread start, so the counting routines never
+// check or allocate.
+const UINT32 CHUNK_BITS = 12;
+const UINT32 CHUNK_SIZE = 1 << CHUNK_BITS;
+const UINT32 CHUNK_MASK = CHUNK_SIZE - 1;
+const UINT32 MAX_CHUNKS = 1024;
+
+class THREAD_STATS : public CACHE_ALIGNED
+{
+  public:
+    UINT64 _inscount;
+    COUNTER *_chunks[MAX_CHUNKS];
+    COUNTER _predicated_true[MAX_INDEX];
+
+    THREAD_STATS() : _inscount(0)
+    {
+        memset(_chunks, 0, sizeof(_chunks));
+        memset(_predicated_true, 0, sizeof(_predicated_true));
+    }
+
+    ~THREAD_STATS()
+    {
+        for (UINT32 i = 0; i < MAX_CHUNKS; i++) CacheAlignedFree(_chunks[i]);
+    }
+
+    // allocates the chunks below num_chunks that are still missing
+    VOID AllocateChunks(UINT32 num_chunks)
+    {
+        for (UINT32 c = 0; c < num_chunks; c++)
+        {
+            if (_chunks[c] == 0) _chunks[c] = static_cast<COUNTER *>(CacheAlignedAlloc(CHUNK_SIZE * sizeof(COUNTER)));
+        }
+    }
+
+    COUNTER BblCount(UINT32 index) const
+    {
+        const COUNTER *chunk = _chunks[index >> CHUNK_BITS];
+        return chunk ? chunk[index & CHUNK_MASK] : 0;
+    }
+};
+
+// Shards indexed by thread id. A plain table rather than a Pin TLS key, so
+// that the counting routines stay branch free and can be inlined.
+LOCALVAR THREAD_STATS *thread_stats[PIN_MAX_THREADS];
+
+// guards live_threads, num_chunks, retired_inscount and the merged counters
+LOCALVAR PIN_LOCK stats_lock;
+LOCALVAR vector<THREAD_STATS *> live_threads;
+
+// chunks every live shard has
+LOCALVAR UINT32 num_chunks = 0;
+
+// instructions counted by threads that already exited
+LOCALVAR UINT64 retired_inscount = 0;
+
+// When a tool register can be claimed, it holds the instruction count of
+// the thread, so count_instructions_reg updates it without touching memory.
+// The count is written to the shard at thread exit. Not used with
+// -num_instructions, which reads the counts at instrumentation time.
+LOCALVAR TOOL_REGISTER stats_reg;
+
+// Makes sure that every shard has the counter of bbl index (instrumentation
+// time, before any code counting into it can run)
+LOCALFUN VOID ReserveBblCounter(UINT32 index)
+{
+    const UINT32 chunk = index >> CHUNK_BITS;
+    if (chunk < num_chunks) return;
+    ASSERT(chunk < MAX_CHUNKS, "more than " + decstr(MAX_CHUNKS * CHUNK_SIZE) + " bbls instrumented");
+
+    PIN_GetLock(&stats_lock, PIN_ThreadId() + 1);
+    num_chunks = chunk + 1;
+    for (UINT32 i = 0; i < live_threads.size(); i++) live_threads[i]->AllocateChunks(num_chunks);
+    PIN_ReleaseLock(&stats_lock);
+}
 
 // This function is called before every block
-VOID count_instructions(UINT32 c) { inscount += c; }
+VOID PIN_FAST_ANALYSIS_CALL count_instructions(UINT32 c, THREADID tid) { thread_stats[tid]->_inscount += c; }
+ADDRINT PIN_FAST_ANALYSIS_CALL count_instructions_reg(ADDRINT count, UINT32 c) { return count + c; }
+
+// -hot: traces only get an execution counter until they are hot; their
+// weight is their number of instructions
+LOCALVAR HOT_TRACES hot_traces;
+
+// Approximate total, only used to decide when to detach
+LOCALFUN UINT64 TotalInscount()
+{
+    PIN_GetLock(&stats_lock, PIN_ThreadId() + 1);
+    UINT64 total = retired_inscount + hot_traces.ColdWeight();
+    for (UINT32 i = 0; i < live_threads.size(); i++) total += live_threads[i]->_inscount;
+    PIN_ReleaseLock(&stats_lock);
+    return total;
+}
 
 /* ===================================================================== */
 
@@ -78,7 +191,6 @@ INT32 Usage()
 /* INDEX HELPERS */
 /* ===================================================================== */
 
-const UINT32 MAX_INDEX = 4096;
 const UINT32 INDEX_SPECIAL =  3000;
 const UINT32 MAX_MEM_SIZE = 520;
 
@@ -216,9 +328,6 @@ LOCALFUN string IndexToOpcodeString( UINT32 index )
 /* ===================================================================== */
 
 
-typedef UINT64 COUNTER;
-
-
 /* zero initialized */
 
 class STATS
@@ -256,16 +365,18 @@ map<UINT32, RTN_TABLE_ENTRY *> rtn_table;
 class BBLSTATS
 {
   public:
-    COUNTER _counter;
+    COUNTER _counter;           // merged from the thread shards
     const UINT16 * const _stats;
     const ADDRINT _addr;
     const UINT32 _rtn_num;
     const UINT32 _size;
     const UINT32 _numins;
+    const UINT32 _index;        // slot of this bbl in the thread shards
+    const UINT32 _cost;         // estimated cost, LATENCY_TABLE::SCALE units
 
   public:
-    BBLSTATS(UINT16 * stats, ADDRINT addr, UINT32 rtn_num, UINT32 size, UINT32 numins ) :
-        _counter(0), _stats(stats), _addr(addr), _rtn_num(rtn_num), _size(size),_numins(numins)  {};
+    BBLSTATS(UINT16 * stats, ADDRINT addr, UINT32 rtn_num, UINT32 size, UINT32 numins, UINT32 index, UINT32 cost ) :
+        _counter(0), _stats(stats), _addr(addr), _rtn_num(rtn_num), _size(size),_numins(numins), _index(index), _cost(cost)  {};
 
 };
 
@@ -276,7 +387,25 @@ LOCALFUN BOOL CompareLess(const BBLSTATS * const & s1 , const BBLSTATS *const &
 }
 
 
-LOCALVAR vector<const BBLSTATS*> statsList;
+LOCALVAR vector<BBLSTATS*> statsList;
+
+// -hot: the bbls of a cold trace are described once and their counts are
+// estimated from the trace's executions while counting was enabled
+// (-control) when the output is written. Once the trace is hot, its bbls
+// count into the same records.
+LOCALVAR vector<pair<hot_trace_t *, BBLSTATS *> > cold_bbls;
+LOCALVAR map<ADDRINT, BBLSTATS *> cold_bbls_by_address;  // not instrumented hot yet
+
+// The record of the cold bbl at addr, if the trace it was in has become hot
+// and is instrumented again with the same bbl; 0 otherwise
+LOCALFUN BBLSTATS *PromotedBbl(ADDRINT addr, UINT32 numins)
+{
+    map<ADDRINT, BBLSTATS *>::iterator it = cold_bbls_by_address.find(addr);
+    if (it == cold_bbls_by_address.end() || it->second->_numins != numins) return 0;
+    BBLSTATS *bblstats = it->second;
+    cold_bbls_by_address.erase(it);
+    return bblstats;
+}
 
 /* ===================================================================== */
 
@@ -303,11 +432,95 @@ LOCALFUN VOID Handler(EVENT_TYPE ev, VOID *, CONTEXT *, VOID *, THREADID, bool b
 
 LOCALVAR CONTROL_MANAGER control;
 
+// writes both profiles so far when the snapshot signal arrives
+LOCALVAR SNAPSHOT snapshot;
+
 
 /* ===================================================================== */
-VOID PIN_FAST_ANALYSIS_CALL docount(COUNTER * counter)
+VOID PIN_FAST_ANALYSIS_CALL docount(UINT32 index, THREADID tid)
+{
+    thread_stats[tid]->_chunks[index >> CHUNK_BITS][index & CHUNK_MASK] += enabled;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL docount_predicated(UINT32 opcode, THREADID tid)
 {
-    (*counter) += enabled;
+    thread_stats[tid]->_predicated_true[opcode] += enabled;
+}
+
+/* ===================================================================== */
+
+// Add the counters of a thread to the global statistics and reset them.
+// The caller holds stats_lock.
+LOCALFUN VOID MergeThreadStats(THREAD_STATS * ts)
+{
+    for (vector<BBLSTATS*>::iterator bi = statsList.begin(); bi != statsList.end(); bi++)
+    {
+        BBLSTATS *b = (*bi);
+        b->_counter += ts->BblCount(b->_index);
+    }
+    for (UINT32 c = 0; c < num_chunks; c++)
+    {
+        memset(ts->_chunks[c], 0, CHUNK_SIZE * sizeof(COUNTER));
+    }
+    for (UINT32 i = 0; i < MAX_INDEX; i++)
+    {
+        GlobalStatsDynamic.predicated_true[i] += ts->_predicated_true[i];
+        ts->_predicated_true[i] = 0;
+    }
+    retired_inscount += ts->_inscount;
+    ts->_inscount = 0;
+}
+
+// The counts of all bbls, by _index, and the dynamic statistics: what the
+// exited threads merged, plus what the live threads have counted so far and
+// the cold estimates. The shards are left as they are, so the output can be
+// written again (snapshots, then Fini).
+LOCALFUN VOID CollectCounts(vector<COUNTER> & counts, STATS & dynamic)
+{
+    PIN_GetLock(&stats_lock, PIN_ThreadId() + 1);
+    counts.assign(statsList.size(), 0);
+    for (UINT32 i = 0; i < statsList.size(); i++)
+    {
+        const BBLSTATS *b = statsList[i];
+        counts[b->_index] = b->_counter;
+        for (UINT32 t = 0; t < live_threads.size(); t++) counts[b->_index] += live_threads[t]->BblCount(b->_index);
+    }
+    for (UINT32 t = 0; t < live_threads.size(); t++)
+    {
+        for (UINT32 i = 0; i < MAX_INDEX; i++) dynamic.predicated_true[i] += live_threads[t]->_predicated_true[i];
+    }
+    PIN_ReleaseLock(&stats_lock);
+
+    for (UINT32 i = 0; i < cold_bbls.size(); i++)
+    {
+        counts[cold_bbls[i].second->_index] += cold_bbls[i].first->enabledExecutions;
+    }
+}
+
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    THREAD_STATS * ts = new THREAD_STATS;
+    thread_stats[tid] = ts;
+    if (stats_reg.Valid()) stats_reg.Init(ctxt, 0);
+
+    PIN_GetLock(&stats_lock, tid + 1);
+    ts->AllocateChunks(num_chunks);
+    live_threads.push_back(ts);
+    PIN_ReleaseLock(&stats_lock);
+}
+
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    THREAD_STATS * ts = thread_stats[tid];
+    if (stats_reg.Valid()) ts->_inscount = stats_reg.Value(ctxt);
+
+    PIN_GetLock(&stats_lock, tid + 1);
+    MergeThreadStats(ts);
+    live_threads.erase(find(live_threads.begin(), live_threads.end(), ts));
+    PIN_ReleaseLock(&stats_lock);
+
+    delete ts;
+    thread_stats[tid] = 0;
 }
 
 /* ===================================================================== */
@@ -318,7 +531,7 @@ VOID Trace(TRACE trace, VOID *v)
          && IMG_Type(SEC_Img(RTN_Sec(TRACE_Rtn(trace)))) == IMG_TYPE_SHAREDLIB)
         return;
 
-    if ( KnobNumInstructions.Value() > 0 && inscount > KnobNumInstructions.Value())
+    if ( KnobNumInstructions.Value() > 0 && TotalInscount() > KnobNumInstructions.Value())
         PIN_Detach();
 
     RTN rtn = TRACE_Rtn(trace);
@@ -348,10 +561,28 @@ VOID Trace(TRACE trace, VOID *v)
     }
     const BOOL accurate_handling_of_predicates = KnobProfilePredicated.Value();
 
+    // a cold trace that is instrumented again is already described
+    hot_trace_t *cold = hot_traces.InstrumentTrace(trace);
+    if (cold && cold->weight != 0) return;
+
     for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
     {
         // Insert a call to count_instructions before every bbl, passing the number of instructions
-        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)count_instructions, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+        if (cold)
+        {
+            cold->weight += BBL_NumIns(bbl);
+        }
+        else if (stats_reg.Valid())
+        {
+            BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)count_instructions_reg, IARG_FAST_ANALYSIS_CALL,
+                           IARG_REG_VALUE, stats_reg.Reg(), IARG_UINT32, BBL_NumIns(bbl),
+                           IARG_RETURN_REGS, stats_reg.Reg(), IARG_END);
+        }
+        else
+        {
+            BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)count_instructions, IARG_FAST_ANALYSIS_CALL,
+                           IARG_UINT32, BBL_NumIns(bbl), IARG_THREAD_ID, IARG_END);
+        }
 
         // Summarize the stats for the bbl in a 0 terminated list
         // This is done at instrumentation time
@@ -363,6 +594,7 @@ VOID Trace(TRACE trace, VOID *v)
 
         UINT32 numins = 0;
         UINT32 size = 0;
+        UINT32 cost = 0;
 
         for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
         {
@@ -371,15 +603,20 @@ VOID Trace(TRACE trace, VOID *v)
 
             numins += 1;
             size += INS_Size(ins);
+            if (KnobCycles) cost += latency_table.Cost(ins);
 
             // Count the number of times a predicated instruction is actually executed
             // this is expensive and hence disabled by default
-            if( INS_IsPredicated(ins) && accurate_handling_of_predicates )
+            if( cold )
+            {
+                // not counted
+            }
+            else if( INS_IsPredicated(ins) && accurate_handling_of_predicates )
             {
                 INS_InsertPredicatedCall(ins,
                                          IPOINT_BEFORE,
-                                         AFUNPTR(docount), IARG_FAST_ANALYSIS_CALL,
-                                         IARG_PTR, &(GlobalStatsDynamic.predicated_true[INS_Opcode(ins)]),
+                                         AFUNPTR(docount_predicated), IARG_FAST_ANALYSIS_CALL,
+                                         IARG_UINT32, INS_Opcode(ins), IARG_THREAD_ID,
                                          IARG_END);
             }
 
@@ -392,18 +629,36 @@ VOID Trace(TRACE trace, VOID *v)
         ASSERTX( curr == stats_end );
 
         // Insert instrumentation to count the number of times the bbl is executed
-        BBLSTATS * bblstats = new BBLSTATS(stats, INS_Address(BBL_InsHead(bbl)), rtn_num, size, numins );
-        INS_InsertCall(BBL_InsHead(bbl), IPOINT_BEFORE, AFUNPTR(docount), IARG_FAST_ANALYSIS_CALL, IARG_PTR, &(bblstats->_counter), IARG_END);
-
-        // Remember the counter and stats so we can compute a summary at the end
-        statsList.push_back(bblstats);
+        const ADDRINT addr = INS_Address(BBL_InsHead(bbl));
+        BBLSTATS * bblstats = cold ? 0 : PromotedBbl(addr, numins);
+        if (bblstats)
+        {
+            delete [] stats;
+        }
+        else
+        {
+            bblstats = new BBLSTATS(stats, addr, rtn_num, size, numins, statsList.size(), cost );
+            ReserveBblCounter(bblstats->_index);
+            // Remember the counter and stats so we can compute a summary at the end
+            statsList.push_back(bblstats);
+        }
+        if (cold)
+        {
+            cold_bbls.push_back(make_pair(cold, bblstats));
+            cold_bbls_by_address[addr] = bblstats;
+        }
+        else
+        {
+            INS_InsertCall(BBL_InsHead(bbl), IPOINT_BEFORE, AFUNPTR(docount), IARG_FAST_ANALYSIS_CALL,
+                           IARG_UINT32, bblstats->_index, IARG_THREAD_ID, IARG_END);
+        }
     }
 
 }
 
 
 /* ===================================================================== */
-LOCALFUN VOID DumpStats(ofstream& out, STATS& stats, BOOL predicated_true,  BOOL print_zeros, const string& title)
+LOCALFUN VOID DumpStats(ostream& out, const STATS& stats, BOOL predicated_true,  BOOL print_zeros, const string& title)
 {
     out <<
         "#\n"
@@ -416,23 +671,29 @@ LOCALFUN VOID DumpStats(ofstream& out, STATS& stats, BOOL predicated_true,  BOOL
 
     out << "\n#\n";
 
+    COUNTER total_unpredicated = stats.unpredicated[INDEX_TOTAL];
+    COUNTER total_predicated = stats.predicated[INDEX_TOTAL];
+    COUNTER total_predicated_true = stats.predicated_true[INDEX_TOTAL];
     for ( UINT32 i = 0; i < INDEX_SPECIAL; i++)
     {
-        stats.unpredicated[INDEX_TOTAL] += stats.unpredicated[i];
-        stats.predicated[INDEX_TOTAL] += stats.predicated[i];
-        stats.predicated_true[INDEX_TOTAL] += stats.predicated_true[i];
+        total_unpredicated += stats.unpredicated[i];
+        total_predicated += stats.predicated[i];
+        total_predicated_true += stats.predicated_true[i];
     }
 
     for ( UINT32 i = 0; i < MAX_INDEX; i++)
     {
+        const BOOL total = i == INDEX_TOTAL;
+        const COUNTER unpredicated = total ? total_unpredicated : stats.unpredicated[i];
+        const COUNTER predicated = total ? total_predicated : stats.predicated[i];
         if( !print_zeros &&
-            stats.unpredicated[i] == 0 &&
-            stats.predicated[i] == 0 ) continue;
+            unpredicated == 0 &&
+            predicated == 0 ) continue;
 
         out << setw(4) << i << " " <<  ljstr(IndexToOpcodeString(i),20) << " " <<
-            setw(16) << stats.unpredicated[i] << " " <<
-            setw(16) << stats.predicated[i];
-        if( predicated_true ) out << " " << setw(16) << stats.predicated_true[i];
+            setw(16) << unpredicated << " " <<
+            setw(16) << predicated;
+        if( predicated_true ) out << " " << setw(16) << (total ? total_predicated_true : stats.predicated_true[i]);
         out << endl;
     }
 }
@@ -441,23 +702,30 @@ LOCALFUN VOID DumpStats(ofstream& out, STATS& stats, BOOL predicated_true,  BOOL
 
 /* ===================================================================== */
 
-VOID PrintDynamicCounts(ofstream& out)
+// bbls is sorted by routine, counts indexed by BBLSTATS::_index, and
+// dynamic has the merged predicated_true counts; its unpredicated counts
+// are added here
+VOID PrintDynamicCounts(ostream& out, const vector<BBLSTATS*> & bbls, const vector<COUNTER> & counts, STATS & dynamic)
 {
-    sort( statsList.begin(), statsList.end(), CompareLess );
-    statsList.push_back(0); // add terminator marker
-
-    STATS DynamicRtn;
+    STATS *DynamicRtn = new STATS;
+    DynamicRtn->Clear();
     UINT32 rtn_num = 0;
 
-    for (vector<const BBLSTATS*>::iterator bi = statsList.begin(); bi != statsList.end(); bi++)
+    // -cycles: executed instructions and estimated cycles of every routine,
+    // starting with rtn 0 (UNKNOWN) which is current before the first bbl
+    vector<UINT32> cycle_rtns(1, 0);
+    vector<COUNTER> cycle_instructions(1, 0);
+    vector<COUNTER> cycle_costs(1, 0);
+
+    for (UINT32 bi = 0; bi <= bbls.size(); bi++)
     {
-        const BBLSTATS *b = (*bi);
+        const BBLSTATS *b = bi < bbls.size() ? bbls[bi] : 0;
 
         if( b  == 0 || rtn_num != b->_rtn_num )
         {
             if( rtn_num>0 && KnobProfileRoutines )
             {
-                DumpStats(out, DynamicRtn, false, 0,
+                DumpStats(out, *DynamicRtn, false, 0,
                           "$rtn-counts " + longstr(rtn_num, rtn_table[rtn_num]->_name) + " at " + hexstr(rtn_table[rtn_num]->_address) );
                 out << "#" << endl;
             }
@@ -465,7 +733,10 @@ VOID PrintDynamicCounts(ofstream& out)
             if( b != 0 )
             {
                 rtn_num = b->_rtn_num;
-                DynamicRtn.Clear();
+                DynamicRtn->Clear();
+                cycle_rtns.push_back(rtn_num);
+                cycle_instructions.push_back(0);
+                cycle_costs.push_back(0);
             }
             else
             {
@@ -474,79 +745,107 @@ VOID PrintDynamicCounts(ofstream& out)
 
         }
 
+        const COUNTER counter = counts[b->_index];
         for (const UINT16 * stats = b->_stats; *stats; stats++)
         {
             ASSERT( *stats < MAX_INDEX,"bad index " + decstr(*stats) + " at " + hexstr(b->_addr) + "\n"  );
-            DynamicRtn.unpredicated[*stats] += b->_counter;
-            GlobalStatsDynamic.unpredicated[*stats] += b->_counter;
+            DynamicRtn->unpredicated[*stats] += counter;
+            dynamic.unpredicated[*stats] += counter;
         }
 
+        cycle_instructions.back() += counter * b->_numins;
+        cycle_costs.back() += counter * b->_cost;
     }
+    delete DynamicRtn;
 
-    DumpStats(out, GlobalStatsDynamic, KnobProfilePredicated, 0, "$dynamic-counts");
+    DumpStats(out, dynamic, KnobProfilePredicated, 0, "$dynamic-counts");
+
+    if( KnobCycles )
+    {
+        out <<
+            "#\n"
+            "# $rtn-cycles\n"
+            "#\n"
+            "#     instructions       est-cycles  rtn\n"
+            "#\n";
+        for (UINT32 i = 0; i < cycle_rtns.size(); i++)
+        {
+            if( cycle_instructions[i] == 0 ) continue;
+            out << setw(18) << cycle_instructions[i] << " " <<
+                setw(16) << cycle_costs[i] / LATENCY_TABLE::SCALE << "  " <<
+                longstr(cycle_rtns[i], rtn_table[cycle_rtns[i]]->_name) << endl;
+        }
+    }
 
     out << "# $eof" <<  endl;
 }
 
 /* ===================================================================== */
 
-VOID PrintBblCount()
+VOID PrintBblCount(ostream& out, const vector<BBLSTATS*> & bbls, const vector<COUNTER> & counts)
 {
-    string filename;
-    std::ofstream out;
-
-    filename =  KnobOutput2File.Value();
-
-    if (KnobPid)
-    {
-        filename += "." + decstr(getpid());
-    }
-
-    out.open(filename.c_str());
-
     out << "BBLCOUNT        1.0         0\n";
 
-    for (vector<const BBLSTATS*>::iterator bi = statsList.begin(); bi != statsList.end(); bi++)
+    for (UINT32 bi = 0; bi < bbls.size(); bi++)
     {
-        const BBLSTATS *b = (*bi);
-        if (b == 0) break; // sentinel
-
-        out << "0x" << hex << b->_addr << " " << dec << b->_counter << " " << b->_numins << " " << b->_size << endl;
+        const BBLSTATS *b = bbls[bi];
+        out << "0x" << hex << b->_addr << " " << dec << counts[b->_index] << " " << b->_numins << " " << b->_size << endl;
     }
 
     out << "# $eof" <<  endl;
-
-    out.close();
 }
 
 /* ===================================================================== */
 
-VOID PrintOutput()
+// Writes the insmix profile to out and the bblcnt profile to bbl_out
+LOCALFUN VOID WriteProfiles(ostream& out, ostream& bbl_out)
 {
-    string filename;
-    std::ofstream out;
+    vector<COUNTER> counts;
+    STATS *dynamic = new STATS;
+    *dynamic = GlobalStatsDynamic;
+    CollectCounts(counts, *dynamic);
 
-    // dump insmix profile
+    vector<BBLSTATS*> bbls(statsList);
+    sort( bbls.begin(), bbls.end(), CompareLess );
 
-    filename =  KnobOutputFile.Value();
+    out << "INSMIX        1.0         0\n";
 
-    if (KnobPid)
+    if (hot_traces.Enabled())
     {
-        filename += "." + decstr(getpid());
+        out << "# $hot-traces " << hot_traces.NumHot() << " of " << hot_traces.Traces().size()
+            << ", counts of the others estimated from " << hot_traces.ColdExecutions() << " executions\n";
     }
-    out.open(filename.c_str());
-
-    out << "INSMIX        1.0         0\n";
 
     DumpStats(out, GlobalStatsStatic, false, 0, "$static-counts");
 
     out << endl;
 
-    PrintDynamicCounts(out);
+    PrintDynamicCounts(out, bbls, counts, *dynamic);
+    delete dynamic;
+
+    PrintBblCount(bbl_out, bbls, counts);
+}
+
+LOCALFUN string OutputFileName(const string & name)
+{
+    return KnobPid ? name + "." + decstr(getpid()) : name;
+}
 
-    out.close();
+VOID PrintOutput()
+{
+    std::ofstream out(OutputFileName(KnobOutputFile.Value()).c_str());
+    std::ofstream bbl_out(OutputFileName(KnobOutput2File.Value()).c_str());
+    WriteProfiles(out, bbl_out);
+}
 
-    PrintBblCount();
+// Snapshot callback: both profiles so far, one after the other
+VOID WriteSnapshot(FILE *out)
+{
+    std::ostringstream profile;
+    std::ostringstream bbl_profile;
+    WriteProfiles(profile, bbl_profile);
+    fputs(profile.str().c_str(), out);
+    fputs(bbl_profile.str().c_str(), out);
 }
 
 /* ===================================================================== */
@@ -614,12 +913,25 @@ int main(int argc, CHAR *argv[])
         return Usage();
     }
 
+    if( !KnobLatencyFile.Value().empty() && !latency_table.Load(KnobLatencyFile.Value().c_str()) )
+    {
+        cerr << "cannot read " << KnobLatencyFile.Value() << endl;
+        return -1;
+    }
+
+    PIN_InitLock(&stats_lock);
+    if (KnobNumInstructions.Value() == 0) stats_reg.Claim();
+    hot_traces.Activate(&enabled);
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
+
     control.RegisterHandler(Handler, 0, FALSE);
     control.Activate();
     TRACE_AddInstrumentFunction(Trace, 0);
 
     PIN_AddFiniFunction(Fini, 0);
     PIN_AddDetachFunction(Detach,0);
+    snapshot.Activate(OutputFileName(KnobOutputFile.Value()), WriteSnapshot);
 
     if( !KnobProfileDynamicOnly.Value() )
         IMG_AddInstrumentFunction(Image, 0);